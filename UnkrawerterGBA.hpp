@@ -35,6 +35,15 @@
 #include <vector>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
+
+// Structure to hold a possible list found by unkrawerter_searchForOffsets.
+struct OffsetCandidate {
+    uint32_t addr;  // Address of the list (for modules, the address of the module)
+    uint32_t count; // Number of entries in the list
+    int type;       // 1 = module, 2 = sample list, 4 = instrument list
+    int confidence; // How likely the list is to be of this type, from 0 to 100
+};
 
 // Structure to hold results from unkrawerter_searchForOffsets.
 struct OffsetSearchResult {
@@ -44,17 +53,63 @@ struct OffsetSearchResult {
     uint32_t sampleAddr = 0;       // Address of sample list
     uint32_t sampleCount = 0;      // Number of samples in list
     std::vector<uint32_t> modules; // List of module addresses
+    uint32_t version = 0;          // Krawall version whose pattern format the modules were detected with
+    bool signatureFound = false;   // Whether the Krawall signature was found
+    uint32_t signatureVersion = 0; // Krawall version read from the signature, or 0 if none was found
+    std::vector<OffsetCandidate> candidates; // All possible lists of each type, best first
+};
+
+// Settings for converting a ROM, passed to the overloads of the functions below that take one.
+// Each thread converting a ROM should use its own context; the functions that don't take a context share
+// a global one, so they can't be used on ROMs with different versions at the same time.
+struct ConversionContext {
+    uint32_t version = 0x20050421; // Krawall version to convert from; this MUST be set for versions older than 2004-07-07
 };
 
-// Sets the Krawall version to convert from. This MUST be used for ROMs using versions older than 2004-07-07.
+// Sets the Krawall version to convert from in the global context used by the functions without a context.
+// This MUST be used for ROMs using versions older than 2004-07-07.
 extern void unkrawerter_setVersion(uint32_t version);
 
 // Searches a ROM file for offsets and returns the results in a structure.
-extern OffsetSearchResult unkrawerter_searchForOffsets(FILE* fp, int threshold = 4, bool verbose = false);
+// If detectVersion is set, the version is read from the ROM's signature; if there isn't one and no modules
+// match the current version's pattern format, the older format is used instead.
+// Pass the version in the result to unkrawerter_setVersion (or store it in the context) before converting.
+extern OffsetSearchResult unkrawerter_searchForOffsets(FILE* fp, int threshold = 4, bool verbose = false, bool detectVersion = false);
+extern OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, FILE* fp, int threshold = 4, bool verbose = false, bool detectVersion = false);
+
+// Searches a ROM already loaded in memory for offsets. The data is read in place without copying.
+extern OffsetSearchResult unkrawerter_searchForOffsets(const uint8_t * data, size_t size, int threshold = 4, bool verbose = false, bool detectVersion = false);
+extern OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, const uint8_t * data, size_t size, int threshold = 4, bool verbose = false, bool detectVersion = false);
+
+// Searches a ROM file for offsets, calling callback with each list as soon as it's confirmed (modules, sample
+// lists and instrument lists that match only one type), in address order. Return false from the callback to
+// stop searching. If stopWhenFound is set, the search stops once a sample list, an instrument list and a
+// module have been found; otherwise the whole ROM is scanned. The callback may be empty.
+// Uses the version in the context or set by unkrawerter_setVersion. If the search stopped early, the results only include the
+// lists found up to that point, and may not include the signature.
+extern OffsetSearchResult unkrawerter_searchForOffsets(FILE* fp, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false);
+extern OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, FILE* fp, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false);
+
+// Searches a ROM already loaded in memory for offsets, calling callback with each list as soon as it's confirmed.
+extern OffsetSearchResult unkrawerter_searchForOffsets(const uint8_t * data, size_t size, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false);
+extern OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, const uint8_t * data, size_t size, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false);
+
+// Looks for modules that a search missed (such as ones with fewer patterns than the threshold) by following
+// pointers to them, using the sample & instrument lists in the search results to validate them.
+// Returns the addresses of any new modules found. Uses the version in the context or set by unkrawerter_setVersion.
+extern std::vector<uint32_t> unkrawerter_discoverModules(FILE* fp, const OffsetSearchResult& offsets, bool verbose = false);
+extern std::vector<uint32_t> unkrawerter_discoverModules(const ConversionContext& ctx, FILE* fp, const OffsetSearchResult& offsets, bool verbose = false);
+
+// Looks for modules that a search missed in a ROM already loaded in memory.
+extern std::vector<uint32_t> unkrawerter_discoverModules(const uint8_t * data, size_t size, const OffsetSearchResult& offsets, bool verbose = false);
+extern std::vector<uint32_t> unkrawerter_discoverModules(const ConversionContext& ctx, const uint8_t * data, size_t size, const OffsetSearchResult& offsets, bool verbose = false);
 
 // Reads a sample at an offset from a ROM file to a WAV file.
 extern void unkrawerter_readSampleToWAV(FILE* fp, uint32_t offset, const char * filename);
 
+// Reads a sample at an offset from a ROM in memory to a WAV file.
+extern void unkrawerter_readSampleToWAV(const uint8_t * data, size_t size, uint32_t offset, const char * filename);
+
 // Writes a single XM module at an offset from a ROM file, using the specified samples and instruments.
 // trimInstruments specifies whether to remove instruments that are not used by the module.
 // name specifies the name of the module; if unset then the module is named "Krawall conversion".
@@ -72,6 +127,48 @@ extern int unkrawerter_writeModuleToXM(
     bool fixCompatibility = true,
     FILE* instfp = NULL
 );
+extern int unkrawerter_writeModuleToXM(
+    const ConversionContext& ctx,
+    FILE* fp,
+    uint32_t moduleOffset,
+    const std::vector<uint32_t> &sampleOffsets,
+    const std::vector<uint32_t> &instrumentOffsets,
+    const char * filename,
+    bool trimInstruments = true,
+    const char * name = NULL,
+    bool fixCompatibility = true,
+    FILE* instfp = NULL
+);
+
+// Writes a single XM module from a ROM in memory. The arguments are the same as above,
+// except that instdata/instsize specify a bank in memory to read instruments from.
+extern int unkrawerter_writeModuleToXM(
+    const uint8_t * data,
+    size_t size,
+    uint32_t moduleOffset,
+    const std::vector<uint32_t> &sampleOffsets,
+    const std::vector<uint32_t> &instrumentOffsets,
+    const char * filename,
+    bool trimInstruments = true,
+    const char * name = NULL,
+    bool fixCompatibility = true,
+    const uint8_t * instdata = NULL,
+    size_t instsize = 0
+);
+extern int unkrawerter_writeModuleToXM(
+    const ConversionContext& ctx,
+    const uint8_t * data,
+    size_t size,
+    uint32_t moduleOffset,
+    const std::vector<uint32_t> &sampleOffsets,
+    const std::vector<uint32_t> &instrumentOffsets,
+    const char * filename,
+    bool trimInstruments = true,
+    const char * name = NULL,
+    bool fixCompatibility = true,
+    const uint8_t * instdata = NULL,
+    size_t instsize = 0
+);
 
 // Writes a module from a file pointer to a new S3M file.
 // trimInstruments specifies whether to remove instruments that are not used by the module.
@@ -87,6 +184,42 @@ extern int unkrawerter_writeModuleToS3M(
     const char * name = NULL,
     FILE* instfp = NULL
 );
+extern int unkrawerter_writeModuleToS3M(
+    const ConversionContext& ctx,
+    FILE* fp,
+    uint32_t moduleOffset,
+    const std::vector<uint32_t> &sampleOffsets,
+    const char * filename,
+    bool trimInstruments = true,
+    const char * name = NULL,
+    FILE* instfp = NULL
+);
+
+// Writes a module from a ROM in memory to a new S3M file. The arguments are the same as above,
+// except that instdata/instsize specify a bank in memory to read samples from.
+extern int unkrawerter_writeModuleToS3M(
+    const uint8_t * data,
+    size_t size,
+    uint32_t moduleOffset,
+    const std::vector<uint32_t> &sampleOffsets,
+    const char * filename,
+    bool trimInstruments = true,
+    const char * name = NULL,
+    const uint8_t * instdata = NULL,
+    size_t instsize = 0
+);
+extern int unkrawerter_writeModuleToS3M(
+    const ConversionContext& ctx,
+    const uint8_t * data,
+    size_t size,
+    uint32_t moduleOffset,
+    const std::vector<uint32_t> &sampleOffsets,
+    const char * filename,
+    bool trimInstruments = true,
+    const char * name = NULL,
+    const uint8_t * instdata = NULL,
+    size_t instsize = 0
+);
 
 /*
     Unkrawerter 4.0 adds a new direct-rip format for dumping the exact pattern
@@ -121,9 +254,15 @@ extern int unkrawerter_writeModuleToS3M(
 // Writes a Krawall Bank file to a path using the specified instrument and sample offsets.
 // Returns true on success, false on error.
 bool unkrawerter_writeBankFile(FILE* fp, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename);
+bool unkrawerter_writeBankFile(const ConversionContext& ctx, FILE* fp, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename);
+bool unkrawerter_writeBankFile(const uint8_t * data, size_t size, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename);
+bool unkrawerter_writeBankFile(const ConversionContext& ctx, const uint8_t * data, size_t size, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename);
 
 // Writes a Krawall Module file to a path using the specified module offset.
 // Returns true on success, false on error.
 bool unkrawerter_writeModuleFile(FILE* fp, uint32_t moduleOffset, const char * filename);
+bool unkrawerter_writeModuleFile(const ConversionContext& ctx, FILE* fp, uint32_t moduleOffset, const char * filename);
+bool unkrawerter_writeModuleFile(const uint8_t * data, size_t size, uint32_t moduleOffset, const char * filename);
+bool unkrawerter_writeModuleFile(const ConversionContext& ctx, const uint8_t * data, size_t size, uint32_t moduleOffset, const char * filename);
 
 #endif
@@ -30,7 +30,9 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstdarg>
 #include <cstring>
+#include <cerrno>
 #include <cmath>
 #include <vector>
 #include <tuple>
@@ -38,6 +40,39 @@
 #include <string>
 #include <algorithm>
 #include <map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <stdexcept>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UNKRAWERTER_USE_SSE2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define UNKRAWERTER_USE_AVX2
+#endif
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#define UNKRAWERTER_USE_MMAP
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 // Maps type numbers detected in searchForOffsets to strings for display (only used in verbose mode)
 static const char * typemap[] = {
@@ -51,9 +86,24 @@ static const char * typemap[] = {
     "any"
 };
 
-// Stores the Krawall version (used to determine some conversion parameters)
-// This defaults to the latest version, but ROMs using versions before 2004-07-07 MUST set this
-static uint32_t version = 0x20050421;
+// Settings shared by every step of converting a ROM. Nothing else is global, so ROMs can be converted
+// at the same time on separate threads as long as each one has its own context.
+struct ConversionContext {
+    // Krawall version (used to determine some conversion parameters)
+    // This defaults to the latest version, but ROMs using versions before 2004-07-07 MUST set this
+    uint32_t version = 0x20050421;
+};
+
+// Context used by the functions that don't take one, set by unkrawerter_setVersion
+static ConversionContext defaultContext;
+
+// Structure to hold a possible list found in an offset search
+struct OffsetCandidate {
+    uint32_t addr;
+    uint32_t count;
+    int type;
+    int confidence;
+};
 
 // Structure to hold results of offset search
 struct OffsetSearchResult {
@@ -63,160 +113,835 @@ struct OffsetSearchResult {
     uint32_t sampleAddr = 0;
     uint32_t sampleCount = 0;
     std::vector<uint32_t> modules;
+    uint32_t version = 0;
+    bool signatureFound = false;
+    uint32_t signatureVersion = 0;
+    std::vector<OffsetCandidate> candidates;
 };
 
 void unkrawerter_setVersion(uint32_t ver) {
-    version = ver;
+    defaultContext.version = ver;
 }
 
-// Searches a ROM file pointer for offsets to modules, an instrument list, and a sample list.
-// This looks for sets of 4-byte aligned addresses in the form 0x08xxxxxx or 0x09xxxxxx
-// Once the sets are found, their types are determined by dereferencing the addresses and checking
-// whether the data stored therein is consistent with the structure type.
-// Sets that don't match exactly one type are discarded.
-// Returns a structure with the addresses to the instrument & sample lists, as well as all modules.
-OffsetSearchResult unkrawerter_searchForOffsets(FILE* fp, int threshold = 4, bool verbose = false) {
-    OffsetSearchResult retval;
-    fseek(fp, 0, SEEK_END);
-    uint32_t romSize = ftell(fp); // Store the ROM's size so addresses that go over are ignored
-    rewind(fp);
-    std::vector<std::tuple<uint32_t, uint32_t, int> > foundAddressLists;
-    uint32_t startAddress = 0, count = 0;
-    // Look for lists of pointers (starting with 0x08xxxxxx or 0x09xxxxxx)
-    uint32_t lastDword = 0;
-    while (!feof(fp) && !ferror(fp)) {
-        fread(&lastDword, 4, 1, fp);
-        if ((lastDword & 0x08000000) && !(lastDword & 0xF6000000) && (lastDword & 0x1ffffff) < romSize && lastDword != 0x08080808 && !((uint16_t)(lastDword >> 16) - (uint16_t)(lastDword & 0xffff) < 4 && (lastDword & 0x00ff00ff) == 0x00080008)) {
-            // Count this address in a set
-            if (startAddress == 0 || count == 0) startAddress = ftell(fp) - 4;
-            count++;
-        } else if (count >= threshold && count < 1024) {
-            // We found an address list, add it to the results
-            foundAddressLists.push_back(std::make_tuple(startAddress, count, 0));
-            startAddress = 0;
-            count = 0;
-        } else if (count > 0) {
-            // Ignore this address (list)
-            startAddress = count = 0;
+// Messages printed while searching or converting. If a thread has a log set, messages are collected in it
+// instead of being printed, so work done on separate threads can have its messages printed in order.
+struct MessageLog {
+    std::vector<std::pair<FILE*, std::string> > messages;
+};
+static thread_local MessageLog * threadLog = NULL;
+// Set once a module is written to stdout, so messages don't end up mixed in with it
+static bool stdoutHasData = false;
+
+// Prints a message to a stream, or adds it to the thread's log if it has one
+static void logMessage(FILE* stream, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (stream == stdout && stdoutHasData) stream = stderr;
+    if (threadLog == NULL) vfprintf(stream, format, args);
+    else {
+        va_list args2;
+        va_copy(args2, args);
+        int len = vsnprintf(NULL, 0, format, args2);
+        va_end(args2);
+        std::string message(len + 1, 0);
+        vsnprintf(&message[0], len + 1, format, args);
+        message.resize(len);
+        threadLog->messages.push_back(std::make_pair(stream, message));
+    }
+    va_end(args);
+}
+
+// Read-only view of a ROM (or bank/module file) in memory.
+// Files are memory-mapped where possible, and are otherwise read in one go, so all
+// scanning and decoding happens on memory instead of through thousands of seeks.
+// Addresses may be either file offsets or GBA addresses (0x08xxxxxx/0x09xxxxxx).
+// All reads are bounds-checked: anything past the end of the image reads as 0.
+class RomImage {
+public:
+    // Wraps a buffer owned by the caller (no copy is made)
+    RomImage(const uint8_t * data, size_t size): ptr(data), len(size), mapping(NULL) {}
+    // Maps or loads an entire file
+    explicit RomImage(FILE* fp): ptr(NULL), len(0), mapping(NULL) {
+#ifdef UNKRAWERTER_USE_MMAP
+        struct stat st;
+        int fd = fileno(fp);
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapping = p;
+                ptr = (const uint8_t*)p;
+                len = st.st_size;
+                return;
+            }
+        }
+#endif
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        rewind(fp);
+        if (size > 0) {
+            storage.resize(size);
+            len = fread(&storage[0], 1, size, fp);
+            ptr = &storage[0];
         }
     }
+    ~RomImage() {
+#ifdef UNKRAWERTER_USE_MMAP
+        if (mapping) munmap(mapping, len);
+#endif
+    }
 
-    // Erase a few matches
-    foundAddressLists.erase(std::remove_if(foundAddressLists.begin(), foundAddressLists.end(), [fp](std::tuple<uint32_t, uint32_t, int>& addr)->bool {
-        // Check for addresses that are too close together
-        int numsize = std::min(std::get<1>(addr), 4u);
-        uint32_t nums[4];
-        fseek(fp, std::get<0>(addr), SEEK_SET);
-        for (int i = 0; i < numsize; i++) fread(nums + i, 4, 1, fp);
-        for (int i = 1; i < numsize; i++) if ((int32_t)nums[i] - (int32_t)nums[i-1] < 0x10) return true;
-        return false;
-    }), foundAddressLists.end());
-
-    // Find the type of each match
-    std::for_each(foundAddressLists.begin(), foundAddressLists.end(), [fp](std::tuple<uint32_t, uint32_t, int> &p) {
-        int possible_mask = 0b111;
-        do { // Check for module
-            fseek(fp, std::get<0>(p) - 8, SEEK_SET);
-            uint32_t tmp = fgetc(fp);
-            if (tmp == 0 || tmp > 0x10) {possible_mask &= 0b110; break;}
-            tmp = fgetc(fp);
-            if (tmp < 30) {possible_mask &= 0b110; break;} // tweak this?
-            for (int i = 0; i < 5; i++) if (fgetc(fp) & 0xfe) {possible_mask &= 0b110; break;}
-            if (!(possible_mask & 1)) break;
-            if (fgetc(fp)) {possible_mask &= 0b110; break;}
-            fread(&tmp, 4, 1, fp);
-            fseek(fp, tmp & 0x1ffffff, SEEK_SET);
-            if (fgetc(fp) || fgetc(fp)) {possible_mask &= 0b110; break;}
-            fgetc(fp);
-            if (fgetc(fp)) {possible_mask &= 0b110; break;}
-            fseek(fp, 28, SEEK_CUR);
-            uint16_t tmp2 = 0;
-            if (version < 0x20040707) tmp2 = fgetc(fp);
-            else fread(&tmp2, 2, 1, fp);
-            if (tmp2 > 256 || (tmp2 & 7)) {possible_mask &= 0b110; break;}
-        } while (0);
-
-        if (std::get<1>(p) < 4) possible_mask &= 0b001;
-        else {
-        for (int i = 0; i < std::min(std::get<1>(p), 4u); i++) { // Check for sample
-            fseek(fp, std::get<0>(p) + i*4, SEEK_SET);
-            uint32_t addr = 0;
-            fread(&addr, 4, 1, fp);
-            fseek(fp, addr & 0x1ffffff, SEEK_SET);
-            uint32_t tmp = 0, end = 0;
-            fread(&tmp, 4, 1, fp);
-            fread(&end, 4, 1, fp);
-            if (!(end & 0x08000000) || (end & 0xf6000000) || end <= addr + 18 || tmp > end - addr - 18) {possible_mask &= 0b101; break;}
-            fread(&tmp, 4, 1, fp);
-            if (tmp > 0xFFFFF) {possible_mask &= 0b101; break;}
-            fseek(fp, 4, SEEK_CUR);
-            if ((fgetc(fp) & 0xfe) || (fgetc(fp) & 0xfe)) {possible_mask &= 0b101; break;}
+    size_t size() const {return len;}
+    const uint8_t * data() const {return ptr;}
+
+    // Returns a pointer to `length` bytes at an address, or NULL if any of it is out of bounds
+    const uint8_t * view(uint32_t addr, size_t length = 1) const {
+        addr &= 0x1ffffff;
+        if (addr > len || length > len - addr) return NULL;
+        return ptr + addr;
+    }
+
+    // Copies bytes at an address to a buffer, filling anything out of bounds with 0
+    void copy(void * dest, uint32_t addr, size_t length) const {
+        addr &= 0x1ffffff;
+        size_t avail = addr < len ? std::min(length, len - addr) : 0;
+        if (avail) memcpy(dest, ptr + addr, avail);
+        if (avail < length) memset((uint8_t*)dest + avail, 0, length - avail);
+    }
+
+    uint8_t u8(uint32_t addr) const {
+        addr &= 0x1ffffff;
+        return addr < len ? ptr[addr] : 0;
+    }
+    uint16_t u16(uint32_t addr) const {uint16_t v; copy(&v, addr, 2); return v;}
+    uint32_t u32(uint32_t addr) const {uint32_t v; copy(&v, addr, 4); return v;}
+
+private:
+    const uint8_t * ptr;
+    size_t len;
+    void * mapping;
+    std::vector<uint8_t> storage;
+    RomImage(const RomImage&);
+    RomImage& operator=(const RomImage&);
+};
+
+// Returns the number of trailing zero bits in a non-zero 64-bit number
+static inline int ctz64(uint64_t n) {
+#ifdef _MSC_VER
+    unsigned long idx;
+#ifdef _WIN64
+    _BitScanForward64(&idx, n);
+#else
+    if (_BitScanForward(&idx, (unsigned long)n)) return idx;
+    _BitScanForward(&idx, (unsigned long)(n >> 32));
+    idx += 32;
+#endif
+    return idx;
+#else
+    return __builtin_ctzll(n);
+#endif
+}
+
+// Checks whether a dword could be a pointer in one of Krawall's lists
+// It must be in the form 0x08xxxxxx or 0x09xxxxxx, point inside the ROM, and not be filler like 0x08080808 or 0x0808xx08
+static inline bool isPointerCandidate(uint32_t dword, uint32_t romSize) {
+    return (dword & 0x08000000) && !(dword & 0xF6000000) && (dword & 0x1ffffff) < romSize && dword != 0x08080808 && !((uint16_t)(dword >> 16) - (uint16_t)(dword & 0xffff) < 4 && (dword & 0x00ff00ff) == 0x00080008);
+}
+
+// The pointer kernels below mark every dword in a buffer that passes isPointerCandidate in a bitmap,
+// with bit n%64 of bits[n/64] set for dword n. All of them must produce identical results.
+typedef void (*PointerKernel)(const uint8_t * data, size_t words, uint32_t romSize, uint64_t * bits);
+
+static void findPointers_scalar(const uint8_t * data, size_t words, uint32_t romSize, uint64_t * bits) {
+    for (size_t w = 0; w < (words + 63) / 64; w++) {
+        uint64_t mask = 0;
+        size_t n = std::min(words - w * 64, (size_t)64);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t dword;
+            memcpy(&dword, data + (w * 64 + i) * 4, 4);
+            if (isPointerCandidate(dword, romSize)) mask |= 1ULL << i;
+        }
+        bits[w] = mask;
+    }
+}
+
+#ifdef UNKRAWERTER_USE_SSE2
+// Pointer check on four dwords at once, returning a 4-bit mask
+static inline int pointerMask_sse2(__m128i v, __m128i limit) {
+    __m128i valid = _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32(0xFE000000)), _mm_set1_epi32(0x08000000));
+    valid = _mm_and_si128(valid, _mm_cmplt_epi32(_mm_and_si128(v, _mm_set1_epi32(0x1ffffff)), limit));
+    __m128i filler = _mm_cmpeq_epi32(v, _mm_set1_epi32(0x08080808));
+    __m128i pair = _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32(0x00ff00ff)), _mm_set1_epi32(0x00080008));
+    pair = _mm_and_si128(pair, _mm_cmplt_epi32(_mm_sub_epi32(_mm_srli_epi32(v, 16), _mm_and_si128(v, _mm_set1_epi32(0xffff))), _mm_set1_epi32(4)));
+    valid = _mm_andnot_si128(_mm_or_si128(filler, pair), valid);
+    return _mm_movemask_ps(_mm_castsi128_ps(valid));
+}
+
+static void findPointers_sse2(const uint8_t * data, size_t words, uint32_t romSize, uint64_t * bits) {
+    __m128i limit = _mm_set1_epi32(std::min(romSize, 0x2000000u));
+    size_t full = words / 64;
+    for (size_t w = 0; w < full; w++) {
+        const uint8_t * ptr = data + w * 256;
+        uint64_t mask = 0;
+        for (int i = 0; i < 16; i++) mask |= (uint64_t)pointerMask_sse2(_mm_loadu_si128((const __m128i*)(ptr + i * 16)), limit) << (i * 4);
+        bits[w] = mask;
+    }
+    if (full * 64 < words) findPointers_scalar(data + full * 256, words - full * 64, romSize, bits + full);
+}
+#endif
+
+#ifdef UNKRAWERTER_USE_AVX2
+// Same as above with eight dwords at once
+__attribute__((target("avx2"))) static inline int pointerMask_avx2(__m256i v, __m256i limit) {
+    __m256i valid = _mm256_cmpeq_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0xFE000000)), _mm256_set1_epi32(0x08000000));
+    valid = _mm256_and_si256(valid, _mm256_cmpgt_epi32(limit, _mm256_and_si256(v, _mm256_set1_epi32(0x1ffffff))));
+    __m256i filler = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(0x08080808));
+    __m256i pair = _mm256_cmpeq_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0x00ff00ff)), _mm256_set1_epi32(0x00080008));
+    pair = _mm256_and_si256(pair, _mm256_cmpgt_epi32(_mm256_set1_epi32(4), _mm256_sub_epi32(_mm256_srli_epi32(v, 16), _mm256_and_si256(v, _mm256_set1_epi32(0xffff)))));
+    valid = _mm256_andnot_si256(_mm256_or_si256(filler, pair), valid);
+    return _mm256_movemask_ps(_mm256_castsi256_ps(valid));
+}
+
+__attribute__((target("avx2"))) static void findPointers_avx2(const uint8_t * data, size_t words, uint32_t romSize, uint64_t * bits) {
+    __m256i limit = _mm256_set1_epi32(std::min(romSize, 0x2000000u));
+    size_t full = words / 64;
+    for (size_t w = 0; w < full; w++) {
+        const uint8_t * ptr = data + w * 256;
+        uint64_t mask = 0;
+        for (int i = 0; i < 8; i++) mask |= (uint64_t)pointerMask_avx2(_mm256_loadu_si256((const __m256i*)(ptr + i * 32)), limit) << (i * 8);
+        bits[w] = mask;
+    }
+    if (full * 64 < words) findPointers_scalar(data + full * 256, words - full * 64, romSize, bits + full);
+}
+#endif
+
+// Picks the fastest pointer kernel the CPU supports
+static PointerKernel selectPointerKernel() {
+#ifdef UNKRAWERTER_USE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return findPointers_avx2;
+#endif
+#ifdef UNKRAWERTER_USE_SSE2
+    return findPointers_sse2;
+#else
+    return findPointers_scalar;
+#endif
+}
+
+static const PointerKernel findPointers = selectPointerKernel();
+
+// Returns the index of the first bit set to `value` at or after `from` in a bitmap, or `limit` if there is none
+static size_t findBit(const uint64_t * bits, size_t from, bool value, size_t limit) {
+    size_t w = from / 64, nwords = (limit + 63) / 64;
+    if (w >= nwords) return limit;
+    uint64_t cur = (value ? bits[w] : ~bits[w]) & (~0ULL << (from % 64));
+    while (!cur) {
+        if (++w >= nwords) return limit;
+        cur = value ? bits[w] : ~bits[w];
+    }
+    return std::min(w * 64 + ctz64(cur), limit);
+}
+
+// Summary of an instrument's 96-entry sample map (note -> sample number)
+struct SampleMapInfo {
+    bool valid;            // Whether entries 0-93 are all <= 256 and differ from the previous entry by <= 16
+    uint64_t highBytes[2]; // Entries with a non-zero high byte (bit i % 64 of highBytes[i / 64])
+};
+
+// Checks an instrument's sample map (192 bytes, need not be aligned). The last two entries aren't
+// checked for validity, since they're sometimes filled with junk. With SSE2, 16 entries are checked
+// at a time, using saturating subtraction to find values over 256 and jumps of more than 16; both
+// paths must give identical results.
+static SampleMapInfo checkSampleMap(const uint8_t * map) {
+    SampleMapInfo retval;
+    uint64_t bad[2] = {0, 0}, high[2] = {0, 0};
+    // buf[i + 1] is entry i, and buf[i] is the entry before it (entry 0 is compared with itself)
+    uint16_t buf[104];
+    memcpy(buf + 1, map, 192);
+    buf[0] = buf[1];
+#ifdef UNKRAWERTER_USE_SSE2
+    const __m128i zero = _mm_setzero_si128(), maxSample = _mm_set1_epi16(256), maxDelta = _mm_set1_epi16(16), highMask = _mm_set1_epi16((short)0xff00);
+    for (int i = 0; i < 96; i += 16) {
+        __m128i ok[2], low[2];
+        for (int j = 0; j < 2; j++) {
+            __m128i cur = _mm_loadu_si128((const __m128i*)(buf + i + j*8 + 1)), prev = _mm_loadu_si128((const __m128i*)(buf + i + j*8));
+            __m128i delta = _mm_or_si128(_mm_subs_epu16(cur, prev), _mm_subs_epu16(prev, cur));
+            ok[j] = _mm_cmpeq_epi16(_mm_or_si128(_mm_subs_epu16(cur, maxSample), _mm_subs_epu16(delta, maxDelta)), zero);
+            low[j] = _mm_cmpeq_epi16(_mm_and_si128(cur, highMask), zero);
+        }
+        bad[i / 64] |= (uint64_t)(~_mm_movemask_epi8(_mm_packs_epi16(ok[0], ok[1])) & 0xffff) << (i % 64);
+        high[i / 64] |= (uint64_t)(~_mm_movemask_epi8(_mm_packs_epi16(low[0], low[1])) & 0xffff) << (i % 64);
+    }
+#else
+    for (int i = 0; i < 96; i++) {
+        uint16_t cur = buf[i + 1], prev = buf[i];
+        if (cur > 256 || abs((int32_t)cur - (int32_t)prev) > 16) bad[i / 64] |= 1ULL << (i % 64);
+        if (cur & 0xff00) high[i / 64] |= 1ULL << (i % 64);
+    }
+#endif
+    retval.valid = !bad[0] && !(bad[1] & ((1ULL << (94 - 64)) - 1));
+    retval.highBytes[0] = high[0];
+    retval.highBytes[1] = high[1];
+    return retval;
+}
+
+// A run of consecutive pointer candidates in a ROM, measured in dwords
+struct PointerRun {
+    size_t start;
+    size_t count;
+    int type; // Possible structure types from classifyPointerList, or -1 if not classified yet
+    uint8_t sampleHits, instrumentHits; // Number of the first 4 entries that look like samples/instruments
+};
+
+// Pointer lists with this many entries or more are assumed to be something other than Krawall data
+#define POINTER_LIST_MAX 1024
+
+// Don't bother splitting the scan into chunks smaller than this many dwords (1 MB)
+#ifndef POINTER_CHUNK_MIN
+#define POINTER_CHUNK_MIN 0x40000
+#endif
+
+// Phases of a search that are timed when profiling
+enum {
+    PHASE_SIGNATURES, // Looking for the Krawall signature
+    PHASE_RUNS,       // Finding & stitching runs of pointers
+    PHASE_TOO_CLOSE,  // Dropping lists whose addresses are too close together
+    PHASE_CLASSIFY,   // Checking the structures that lists point to
+    PHASE_RESULTS,    // Picking the format, lists & candidates from the classified lists
+    PHASE_COUNT
+};
+static const char * const phaseNames[PHASE_COUNT] = {"signatures", "runs", "tooClose", "classification", "results"};
+
+// Checks in classifyPointerList that can rule out a type for a list
+enum {
+    RULE_TOO_CLOSE,            // Addresses are less than 16 bytes apart (all types)
+    RULE_MODULE_SPEED,         // Initial speed is 0 or over 16
+    RULE_MODULE_TEMPO,         // Initial tempo is under 30
+    RULE_MODULE_FLAGS,         // Flags aren't 0 or 1
+    RULE_MODULE_PADDING,       // Padding before the pattern list isn't 0
+    RULE_PATTERN_INDEX,        // First pattern's index doesn't start with 0
+    RULE_PATTERN_ROWS,         // First pattern's row count is invalid in the current format
+    RULE_PATTERN_ROWS_OLD,     // First pattern's row count is invalid in the pre-2004-07-07 format
+    RULE_SHORT_LIST,           // Fewer than 4 entries (samples & instruments)
+    RULE_SAMPLE_END,           // Sample end address or loop length is invalid
+    RULE_SAMPLE_RATE,          // Sample rate is too high
+    RULE_SAMPLE_FLAGS,         // Loop/HQ flags aren't 0 or 1
+    RULE_INSTRUMENT_MAP,       // Sample map has gaps or is out of range
+    RULE_INSTRUMENT_VOLUME,    // Volume envelope sustain/loop points are out of range
+    RULE_INSTRUMENT_PANNING,   // Panning envelope sustain/loop points are out of range
+    RULE_COUNT
+};
+static const char * const ruleNames[RULE_COUNT] = {
+    "tooClose", "moduleSpeed", "moduleTempo", "moduleFlags", "modulePadding", "patternIndex", "patternRows", "patternRowsOld",
+    "shortList", "sampleEnd", "sampleRate", "sampleFlags", "instrumentMap", "instrumentVolumeEnvelope", "instrumentPanningEnvelope"
+};
+
+// Runs of pointers are counted in buckets by length: 1, 2-3, 4-7, ..., 512-1023, 1024+
+#define RUN_BUCKETS 11
+
+// Statistics collected during a search when profiling. Times are in seconds, and phase times are
+// summed over all threads, so they can add up to more than the wall time.
+struct ScanProfile {
+    uint32_t romSize = 0;
+    uint32_t threshold = 0;
+    uint32_t chunks = 0;
+    double wallTime = 0;
+    double phaseTime[PHASE_COUNT] = {};
+    uint32_t runLengths[RUN_BUCKETS] = {};
+    uint32_t classified = 0;            // Lists passed to classifyPointerList
+    uint32_t rejections[RULE_COUNT] = {}; // Number of lists each check ruled out a type for
+    uint32_t lists[5] = {};             // Classified lists that are modules, samples, instruments, multiple types, no type
+
+    void addRun(size_t count) {
+        int bucket = 0;
+        while (count > 1 && bucket < RUN_BUCKETS - 1) {count >>= 1; bucket++;}
+        runLengths[bucket]++;
+    }
+
+    // Adds the counters & times from a profile of another part of the scan
+    void merge(const ScanProfile& other) {
+        for (int i = 0; i < PHASE_COUNT; i++) phaseTime[i] += other.phaseTime[i];
+        for (int i = 0; i < RUN_BUCKETS; i++) runLengths[i] += other.runLengths[i];
+        for (int i = 0; i < RULE_COUNT; i++) rejections[i] += other.rejections[i];
+        classified += other.classified;
+    }
+};
+
+// Adds the time spent in a phase to a profile; does nothing if there's no profile
+class PhaseTimer {
+    ScanProfile * profile;
+    int phase;
+    std::chrono::steady_clock::time_point start;
+public:
+    PhaseTimer(ScanProfile * p, int ph): profile(p), phase(-1) {next(ph);}
+    ~PhaseTimer() {stop();}
+    // Ends the current phase and starts timing another one
+    void next(int ph) {
+        stop();
+        phase = ph;
+        if (profile) start = std::chrono::steady_clock::now();
+    }
+    // Ends the current phase without starting another one
+    void stop() {
+        if (profile && phase >= 0) profile->phaseTime[phase] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        phase = -1;
+    }
+};
+
+// Signature strings that Krawall leaves in ROMs, looked for during the pointer scan
+enum {
+    SIGNATURE_KRAWALL,   // $Id: Krawall
+    SIGNATURE_DATE,      // $Date: 2000/01/01
+    SIGNATURE_VERSION_H, // $Id: version.h 8 2000-01-01
+    SIGNATURE_COUNT
+};
+static const char * const signatures[SIGNATURE_COUNT] = {"$Id: Krawall", "$Date: ", "$Id: version.h 8 "};
+
+// Finds the first occurrence of each signature starting between two byte offsets. Matches may
+// extend past the end of the range, so signatures crossing a chunk boundary are still found.
+// Stores the offset just past each signature in found, or -1 if it wasn't found.
+static void findSignatures(const RomImage& rom, size_t begin, size_t end, long * found) {
+    int remaining = SIGNATURE_COUNT;
+    for (int i = 0; i < SIGNATURE_COUNT; i++) found[i] = -1;
+    const uint8_t * data = rom.data();
+    // Every signature starts with '$', so only those bytes need to be checked
+    for (const uint8_t * p = (const uint8_t*)memchr(data + begin, '$', end - begin); p && remaining; p = (const uint8_t*)memchr(p + 1, '$', data + end - p - 1)) {
+        size_t pos = p - data;
+        for (int i = 0; i < SIGNATURE_COUNT; i++) {
+            size_t len = strlen(signatures[i]);
+            if (found[i] < 0 && len <= rom.size() - pos && memcmp(p, signatures[i], len) == 0) {
+                found[i] = pos + len;
+                remaining--;
+            }
+        }
+    }
+}
+
+// Determines which structures a list of pointers could point to, by dereferencing the first few
+// addresses and checking whether the data stored therein is consistent with each structure type.
+// Returns a mask of the possible types (1 = module, 2 = sample, 4 = instrument, 8 = module using the
+// pre-2004-07-07 pattern format with a 1-byte row count), or -1 if the addresses are too close
+// together to be a list of structures. This only reads from the ROM, so it can run on any thread.
+// If hits is set, it receives the number of the first 4 entries that passed the sample and
+// instrument checks, which is used to rate lists that only partially match.
+// If profile is set, the time taken and the check that ruled out each type are recorded in it. For
+// samples & instruments, the first check that failed for any entry is counted.
+static int classifyPointerList(const RomImage& rom, uint32_t listAddr, uint32_t count, uint8_t * hits = NULL, ScanProfile * profile = NULL) {
+    PhaseTimer timer(profile, PHASE_TOO_CLOSE);
+    if (profile) profile->classified++;
+    // Check for addresses that are too close together
+    int numsize = std::min(count, 4u);
+    uint32_t nums[4];
+    for (int i = 0; i < numsize; i++) nums[i] = rom.u32(listAddr + i*4);
+    for (int i = 1; i < numsize; i++) if ((int32_t)nums[i] - (int32_t)nums[i-1] < 0x10) {
+        if (profile) profile->rejections[RULE_TOO_CLOSE]++;
+        return -1;
+    }
+    timer.next(PHASE_CLASSIFY);
+
+    int possible_mask = 0b1111;
+    int rule = -1;
+    do { // Check for module
+        uint32_t pos = listAddr - 8;
+        uint32_t tmp = rom.u8(pos);
+        if (tmp == 0 || tmp > 0x10) {possible_mask &= 0b0110; rule = RULE_MODULE_SPEED; break;}
+        tmp = rom.u8(pos + 1);
+        if (tmp < 30) {possible_mask &= 0b0110; rule = RULE_MODULE_TEMPO; break;} // tweak this?
+        for (int i = 0; i < 5; i++) if (rom.u8(pos + 2 + i) & 0xfe) {possible_mask &= 0b0110; rule = RULE_MODULE_FLAGS; break;}
+        if (!(possible_mask & 1)) break;
+        if (rom.u8(pos + 7)) {possible_mask &= 0b0110; rule = RULE_MODULE_PADDING; break;}
+        pos = rom.u32(pos + 8) & 0x1ffffff;
+        if (rom.u8(pos) || rom.u8(pos + 1)) {possible_mask &= 0b0110; rule = RULE_PATTERN_INDEX; break;}
+        if (rom.u8(pos + 3)) {possible_mask &= 0b0110; rule = RULE_PATTERN_INDEX; break;}
+        uint16_t tmp2 = rom.u16(pos + 32);
+        if (tmp2 > 256 || (tmp2 & 7)) {possible_mask &= 0b1110; if (profile) profile->rejections[RULE_PATTERN_ROWS]++;}
+        tmp2 = rom.u8(pos + 32);
+        if (tmp2 & 7) {possible_mask &= 0b0111; if (profile) profile->rejections[RULE_PATTERN_ROWS_OLD]++;}
+    } while (0);
+    if (profile && rule >= 0) profile->rejections[rule]++;
+
+    uint8_t sampleHits = 0, instrumentHits = 0;
+    if (count < 4) {
+        possible_mask &= 0b1001;
+        if (profile) profile->rejections[RULE_SHORT_LIST]++;
+    } else {
+        rule = -1;
+        for (int i = 0; i < 4; i++) { // Check for sample
+            uint32_t addr = rom.u32(listAddr + i*4);
+            uint32_t pos = addr & 0x1ffffff;
+            uint32_t tmp = rom.u32(pos), end = rom.u32(pos + 4);
+            if (!(end & 0x08000000) || (end & 0xf6000000) || end <= addr + 18 || tmp > end - addr - 18) {if (rule < 0) rule = RULE_SAMPLE_END; continue;}
+            tmp = rom.u32(pos + 8);
+            if (tmp > 0xFFFFF) {if (rule < 0) rule = RULE_SAMPLE_RATE; continue;}
+            if ((rom.u8(pos + 16) & 0xfe) || (rom.u8(pos + 17) & 0xfe)) {if (rule < 0) rule = RULE_SAMPLE_FLAGS; continue;}
+            sampleHits++;
         }
+        if (sampleHits < 4) possible_mask &= 0b1101;
+        if (profile && rule >= 0) profile->rejections[rule]++;
 
-        for (int n = 0; n < std::min(std::get<1>(p), 4u); n++) { // Check for instrument
-            fseek(fp, std::get<0>(p) + n*4, SEEK_SET);
-            uint32_t addr = 0;
-            fread(&addr, 4, 1, fp);
-            fseek(fp, addr & 0x1ffffff, SEEK_SET);
-            uint16_t tmp = 0, last = 0;
-            for (int i = 0; i < 96; i++) {
-                fread(&tmp, 2, 1, fp);
-                if ((tmp > 256 || (i > 0 && abs((int32_t)tmp - (int32_t)last) > 16)) && i < 94) {possible_mask &= 0b011; break;}
-                last = tmp;
+        rule = -1;
+        for (int n = 0; n < 4; n++) { // Check for instrument
+            uint32_t pos = rom.u32(listAddr + n*4) & 0x1ffffff;
+            uint8_t map[192];
+            const uint8_t * samples = rom.view(pos, 192);
+            if (samples == NULL) {
+                rom.copy(map, pos, 192);
+                samples = map;
             }
-            if (!(possible_mask & 4)) break;
-            fseek(fp, 48, SEEK_CUR);
-            fgetc(fp); //if (fgetc(fp) > 12) {possible_mask &= 0b011; break;}
-            if (fgetc(fp) > 12) {possible_mask &= 0b011; break;}
-            if (fgetc(fp) > 12) {possible_mask &= 0b011; break;}
-            fgetc(fp); //if (fgetc(fp) > 0x10) {possible_mask &= 0b011; break;} // I think?
-            fseek(fp, 48, SEEK_CUR);
-            fgetc(fp); //if (fgetc(fp) > 12) {possible_mask &= 0b011; break;}
-            if (fgetc(fp) > 12) {possible_mask &= 0b011; break;}
-            if (fgetc(fp) > 12) {possible_mask &= 0b011; break;}
-            fgetc(fp); //if (fgetc(fp) > 0x10) {possible_mask &= 0b011; break;}
+            if (!checkSampleMap(samples).valid) {if (rule < 0) rule = RULE_INSTRUMENT_MAP; continue;}
+            pos += 192 + 48; // skip sample map & volume envelope nodes
+            //if (rom.u8(pos) > 12) continue;
+            if (rom.u8(pos + 1) > 12 || rom.u8(pos + 2) > 12) {if (rule < 0) rule = RULE_INSTRUMENT_VOLUME; continue;}
+            //if (rom.u8(pos + 3) > 0x10) continue; // I think?
+            pos += 4 + 48; // skip panning envelope nodes
+            //if (rom.u8(pos) > 12) continue;
+            if (rom.u8(pos + 1) > 12 || rom.u8(pos + 2) > 12) {if (rule < 0) rule = RULE_INSTRUMENT_PANNING; continue;}
+            //if (rom.u8(pos + 3) > 0x10) continue;
+            instrumentHits++;
         }
+        if (instrumentHits < 4) possible_mask &= 0b1011;
+        if (profile && rule >= 0) profile->rejections[rule]++;
+    }
+    if (hits) {
+        hits[0] = sampleHits;
+        hits[1] = instrumentHits;
+    }
+    return possible_mask;
+}
+
+// Finds all pointer lists between two dword indices (which must be multiples of 64) with at least
+// `threshold` entries, and classifies each one as soon as it ends. Runs touching either end of the
+// range may continue into the neighboring chunks, so they're returned unclassified regardless of
+// length. Fills in the matching part of the bitmap.
+// Signatures starting in the chunk (up to byte offset sigEnd) are searched for while the data is hot.
+// If profile is set, statistics for the chunk are added to it; runs touching the ends aren't counted.
+static void findPointerListsInChunk(const RomImage& rom, size_t first, size_t last, size_t sigEnd, uint32_t threshold, uint64_t * bits, std::vector<PointerRun>& runs, long * found, ScanProfile * profile = NULL) {
+    PhaseTimer timer(profile, PHASE_RUNS);
+    findPointers(rom.data() + first * 4, last - first, rom.size(), bits + first / 64);
+    for (size_t start = findBit(bits, first, true, last); start < last;) {
+        size_t end = findBit(bits, start, false, last);
+        uint32_t count = end - start;
+        if (start == first || end == last) runs.push_back({start, count, -1, 0, 0});
+        else {
+            if (profile) profile->addRun(count);
+            if (count >= threshold && count < POINTER_LIST_MAX) {
+                uint8_t hits[2];
+                timer.stop();
+                int type = classifyPointerList(rom, start * 4, count, hits, profile);
+                timer.next(PHASE_RUNS);
+                if (type >= 0) runs.push_back({start, count, type, hits[0], hits[1]});
+            }
+        }
+        start = findBit(bits, end, true, last);
+    }
+    timer.next(PHASE_SIGNATURES);
+    findSignatures(rom, first * 4, sigEnd, found);
+}
+
+// Finds and classifies all lists of pointers in a ROM with at least `threshold` entries.
+// Lists that run into the end of the ROM are never terminated, so they're ignored. Lists whose
+// addresses are too close together are dropped. The ROM is split into chunks that are scanned and
+// classified on separate threads, and runs crossing chunk boundaries are stitched back together and
+// classified afterwards, so the result is the same as a serial scan.
+// If signaturePos is set, it receives the offset just past the first occurrence of each signature (or -1).
+// nthreads specifies the maximum number of threads to use; if 0, one thread per CPU core is used.
+// If profile is set, the statistics from every chunk are collected into it.
+static std::vector<PointerRun> findPointerLists(const RomImage& rom, uint32_t threshold, long * signaturePos = NULL, size_t nthreads = 0, ScanProfile * profile = NULL) {
+    size_t words = rom.size() / 4;
+    std::vector<uint64_t> bits((words + 63) / 64);
+    if (nthreads == 0) nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t chunkSize = std::max((words / nthreads + 63) & ~(size_t)63, (size_t)POINTER_CHUNK_MIN);
+    size_t nchunks = words ? (words + chunkSize - 1) / chunkSize : 0;
+    std::vector<std::vector<PointerRun> > chunkRuns(nchunks);
+    std::vector<long> chunkSignatures(nchunks * SIGNATURE_COUNT);
+    std::vector<ScanProfile> chunkProfiles(profile ? nchunks : 0);
+    std::vector<std::thread> threads;
+    // The last chunk also covers any bytes after the last full dword
+    for (size_t i = 1; i < nchunks; i++) threads.push_back(std::thread(findPointerListsInChunk, std::cref(rom), i * chunkSize, std::min((i + 1) * chunkSize, words), i == nchunks - 1 ? rom.size() : (i + 1) * chunkSize * 4, threshold, bits.data(), std::ref(chunkRuns[i]), &chunkSignatures[i * SIGNATURE_COUNT], profile ? &chunkProfiles[i] : NULL));
+    if (nchunks) findPointerListsInChunk(rom, 0, std::min(chunkSize, words), nchunks == 1 ? rom.size() : chunkSize * 4, threshold, bits.data(), chunkRuns[0], &chunkSignatures[0], profile ? &chunkProfiles[0] : NULL);
+    for (std::thread& t : threads) t.join();
+    if (profile) {
+        profile->chunks = nchunks;
+        for (const ScanProfile& p : chunkProfiles) profile->merge(p);
+    }
+    // Stitch together runs that continue from one chunk into the next
+    PhaseTimer timer(profile, PHASE_RUNS);
+    std::vector<PointerRun> runs;
+    for (const std::vector<PointerRun>& chunk : chunkRuns) {
+        for (const PointerRun& run : chunk) {
+            if (!runs.empty() && runs.back().start + runs.back().count == run.start) runs.back().count += run.count;
+            else runs.push_back(run);
+        }
+    }
+    if (profile) for (const PointerRun& run : runs) if (run.type < 0) profile->addRun(run.count);
+    if (!runs.empty() && runs.back().start + runs.back().count == words) runs.pop_back();
+    timer.stop();
+    // Classify the runs that touched chunk edges, dropping ones that aren't lists
+    runs.erase(std::remove_if(runs.begin(), runs.end(), [&rom, threshold, profile](PointerRun& run)->bool {
+        if (run.type >= 0) return false;
+        if (run.count < threshold || run.count >= POINTER_LIST_MAX) return true;
+        uint8_t hits[2];
+        run.type = classifyPointerList(rom, run.start * 4, run.count, hits, profile);
+        run.sampleHits = hits[0];
+        run.instrumentHits = hits[1];
+        return run.type < 0;
+    }), runs.end());
+    // The earliest chunk that found a signature has its first occurrence
+    if (signaturePos) {
+        for (int i = 0; i < SIGNATURE_COUNT; i++) {
+            signaturePos[i] = -1;
+            for (size_t c = 0; c < nchunks && signaturePos[i] < 0; c++) signaturePos[i] = chunkSignatures[c * SIGNATURE_COUNT + i];
         }
-        std::get<2>(p) = possible_mask;
+    }
+    return runs;
+}
+
+// Reads a version date in the form 2000/01/01 or 2000-01-01 into 0xYYYYMMDD
+static uint32_t readVersionDate(const RomImage& rom, long pos) {
+    char tmp[11];
+    rom.copy(tmp, pos, 10);
+    tmp[10] = 0;
+    return ((tmp[0] - '0') << 28) | ((tmp[1] - '0') << 24) | ((tmp[2] - '0') << 20) | ((tmp[3] - '0') << 16) | ((tmp[5] - '0') << 12) | ((tmp[6] - '0') << 8) | ((tmp[8] - '0') << 4) | (tmp[9] - '0');
+}
+
+// Prints a brief of the lists & modules found in a search
+static void showOffsetSearchResult(const OffsetSearchResult& result) {
+    if (result.instrumentAddr) logMessage(stdout, "> Found instrument list at address %08X\n", result.instrumentAddr);
+    if (result.sampleAddr) logMessage(stdout, "> Found sample list at address %08X\n", result.sampleAddr);
+    for (uint32_t addr : result.modules) logMessage(stdout, "> Found module at address %08X\n", addr);
+}
+
+// Adds the candidates for each type a classified list may be.
+// A list that passes all checks for n types gets a confidence of 100/n for each; lists that
+// only partially pass the sample or instrument checks are rated by the fraction that passed
+static void addCandidates(std::vector<OffsetCandidate>& candidates, const PointerRun& p) {
+    int types = (p.type & 1) + ((p.type >> 1) & 1) + ((p.type >> 2) & 1);
+    uint32_t addr = p.start * 4, count = p.count;
+    if (p.type & 1) candidates.push_back({(addr & 0x1ffffff) - 364, count, 1, 100 / types});
+    if (p.sampleHits) candidates.push_back({addr, count, 2, p.sampleHits * 25 / (p.type & 2 ? types : types + 1)});
+    if (p.instrumentHits) candidates.push_back({addr, count, 4, p.instrumentHits * 25 / (p.type & 4 ? types : types + 1)});
+}
+
+// Sorts candidates by confidence, then by list length
+static void sortCandidates(std::vector<OffsetCandidate>& candidates) {
+    std::stable_sort(candidates.begin(), candidates.end(), [](const OffsetCandidate& a, const OffsetCandidate& b)->bool {
+        return a.confidence != b.confidence ? a.confidence > b.confidence : a.count > b.count;
     });
+}
+
+// Searches a ROM image for offsets to modules, an instrument list, and a sample list.
+// This looks for sets of 4-byte aligned addresses in the form 0x08xxxxxx or 0x09xxxxxx
+// Once the sets are found, their types are determined by dereferencing the addresses and checking
+// whether the data stored therein is consistent with the structure type.
+// Sets that don't match exactly one type are discarded.
+// Modules are checked against both pattern formats in the same pass. The Krawall signature and version
+// strings are looked for during the pointer scan as well. If detectVersion is set, the version from the
+// signature is used if there is one; otherwise, if no modules match the current version's format, the
+// results for the pre-2004-07-07 format are used instead.
+// Returns a structure with the addresses to the instrument & sample lists, all modules, and the version used.
+// If profile is set, timings & statistics for the search are stored in it. nthreads is the maximum number
+// of threads for the pointer scan, as in findPointerLists.
+static OffsetSearchResult searchForOffsets(const ConversionContext& ctx, const RomImage& rom, int threshold, bool verbose, bool detectVersion = false, ScanProfile * profile = NULL, size_t nthreads = 0) {
+    OffsetSearchResult retval;
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    // Look for lists of pointers (starting with 0x08xxxxxx or 0x09xxxxxx)
+    // Each list is classified as soon as the scan finds it
+    long signaturePos[SIGNATURE_COUNT];
+    std::vector<PointerRun> foundAddressLists = findPointerLists(rom, threshold, signaturePos, nthreads, profile);
+    PhaseTimer timer(profile, PHASE_RESULTS);
+
+    // Read the version from the signature: $Date: 2000/01/01 or $Id: version.h 8 2000-01-01
+    retval.signatureFound = signaturePos[SIGNATURE_KRAWALL] >= 0;
+    if (retval.signatureFound && signaturePos[SIGNATURE_DATE] >= 0) retval.signatureVersion = readVersionDate(rom, signaturePos[SIGNATURE_DATE]);
+    else if (retval.signatureFound && signaturePos[SIGNATURE_VERSION_H] >= 0) retval.signatureVersion = readVersionDate(rom, signaturePos[SIGNATURE_VERSION_H]);
+    if (detectVersion && retval.signatureVersion) {
+        logMessage(stdout, "Krawall version: %08x\n", retval.signatureVersion);
+        retval.version = retval.signatureVersion;
+    } else retval.version = ctx.version;
+
+    // Pick the pattern format: fall back to the old format if nothing is a module in the current one
+    bool oldFormat = retval.version < 0x20040707;
+    if (detectVersion && !retval.signatureVersion && !oldFormat && std::none_of(foundAddressLists.begin(), foundAddressLists.end(), [](const PointerRun& p){return (p.type & 0b0111) == 1;})) {
+        oldFormat = true;
+        retval.version = 0x20030901;
+    }
+    for (PointerRun& p : foundAddressLists) p.type = (p.type & 0b0110) | (oldFormat ? p.type >> 3 : p.type & 1);
+    if (profile) {
+        for (const PointerRun& p : foundAddressLists) {
+            if (p.type == 0) profile->lists[4]++;
+            else if (p.type == 1 || p.type == 2 || p.type == 4) profile->lists[p.type >> 1]++;
+            else profile->lists[3]++;
+        }
+    }
 
     // Show results if verbose
-    if (verbose) std::for_each(foundAddressLists.begin(), foundAddressLists.end(), [](std::tuple<uint32_t, uint32_t, int> p){printf("Found %d matches at %08X with type %s\n", std::get<1>(p), std::get<0>(p), typemap[std::get<2>(p)]);});
+    if (verbose) for (const PointerRun& p : foundAddressLists) logMessage(stdout, "Found %d matches at %08X with type %s\n", (int)p.count, (uint32_t)p.start * 4, typemap[p.type]);
 
     // Filter results down to one instrument & sample list, and all modules
-    for (auto p : foundAddressLists) {
-        if (std::get<2>(p) == 1) retval.modules.push_back(std::get<0>(p));
-        else if (std::get<2>(p) == 2 && std::get<1>(p) > retval.sampleCount) {retval.sampleCount = std::get<1>(p); retval.sampleAddr = std::get<0>(p);}
-        else if (std::get<2>(p) == 4 && std::get<1>(p) > retval.instrumentCount) {retval.instrumentCount = std::get<1>(p); retval.instrumentAddr = std::get<0>(p);}
+    for (const PointerRun& p : foundAddressLists) {
+        if (p.type == 1) retval.modules.push_back(p.start * 4);
+        else if (p.type == 2 && p.count > retval.sampleCount) {retval.sampleCount = p.count; retval.sampleAddr = p.start * 4;}
+        else if (p.type == 4 && p.count > retval.instrumentCount) {retval.instrumentCount = p.count; retval.instrumentAddr = p.start * 4;}
+    }
+
+    // Rate every possible list, so other candidates can be tried if the best pick is wrong
+    for (const PointerRun& p : foundAddressLists) addCandidates(retval.candidates, p);
+    sortCandidates(retval.candidates);
+
+    // Convert pattern lists to module addresses & show brief of results
+    for (int i = 0; i < retval.modules.size(); i++) retval.modules[i] = (retval.modules[i] & 0x1ffffff) - 364;
+    timer.stop();
+    if (profile) {
+        profile->romSize = rom.size();
+        profile->threshold = threshold;
+        profile->wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
     }
+    showOffsetSearchResult(retval);
+
+    retval.success = retval.sampleAddr && !retval.modules.empty();
+    return retval;
+}
+
+OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, FILE* fp, int threshold = 4, bool verbose = false, bool detectVersion = false) {
+    RomImage rom(fp);
+    return searchForOffsets(ctx, rom, threshold, verbose, detectVersion);
+}
+
+OffsetSearchResult unkrawerter_searchForOffsets(FILE* fp, int threshold = 4, bool verbose = false, bool detectVersion = false) {
+    return unkrawerter_searchForOffsets(defaultContext, fp, threshold, verbose, detectVersion);
+}
+
+OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, const uint8_t * data, size_t size, int threshold = 4, bool verbose = false, bool detectVersion = false) {
+    RomImage rom(data, size);
+    return searchForOffsets(ctx, rom, threshold, verbose, detectVersion);
+}
 
-    // Show brief of results
-    if (retval.instrumentAddr) printf("> Found instrument list at address %08X\n", retval.instrumentAddr);
-    if (retval.sampleAddr) printf("> Found sample list at address %08X\n", retval.sampleAddr);
-    for (int i = 0; i < retval.modules.size(); i++) {
-        retval.modules[i] = (retval.modules[i] & 0x1ffffff) - 364;
-        printf("> Found module at address %08X\n", retval.modules[i]);
+OffsetSearchResult unkrawerter_searchForOffsets(const uint8_t * data, size_t size, int threshold = 4, bool verbose = false, bool detectVersion = false) {
+    return unkrawerter_searchForOffsets(defaultContext, data, size, threshold, verbose, detectVersion);
+}
+
+// Scans a ROM for lists of pointers in address order, one chunk at a time, calling `found` with each
+// classified list as soon as the chunk it ends in has been scanned. Runs crossing chunk boundaries are
+// carried over into the next chunk, so the lists are the same as findPointerLists returns.
+// Stops as soon as `found` returns false. signaturePos receives the signatures seen so far.
+static void scanPointerListsInOrder(const RomImage& rom, uint32_t threshold, long * signaturePos, const std::function<bool(const PointerRun&)>& found) {
+    size_t words = rom.size() / 4;
+    std::vector<uint64_t> bits((words + 63) / 64);
+    std::vector<PointerRun> runs;
+    PointerRun open = {0, 0, -1, 0, 0};
+    long chunkSignatures[SIGNATURE_COUNT];
+    // Classifies a finished run if it wasn't already, and passes it on if it's a list
+    auto finish = [&rom, threshold, &found](PointerRun list)->bool {
+        if (list.type < 0) {
+            if (list.count < threshold || list.count >= POINTER_LIST_MAX) return true;
+            uint8_t hits[2];
+            list.type = classifyPointerList(rom, list.start * 4, list.count, hits);
+            list.sampleHits = hits[0];
+            list.instrumentHits = hits[1];
+            if (list.type < 0) return true;
+        }
+        return found(list);
+    };
+    for (int i = 0; i < SIGNATURE_COUNT; i++) signaturePos[i] = -1;
+    for (size_t first = 0; first < words; first += POINTER_CHUNK_MIN) {
+        size_t last = std::min(first + POINTER_CHUNK_MIN, words);
+        runs.clear();
+        findPointerListsInChunk(rom, first, last, last == words ? rom.size() : last * 4, threshold, bits.data(), runs, chunkSignatures);
+        for (int i = 0; i < SIGNATURE_COUNT; i++) if (signaturePos[i] < 0) signaturePos[i] = chunkSignatures[i];
+        // A run left open by the last chunk ends here unless this chunk starts with its continuation
+        if (open.count && (runs.empty() || runs.front().start != first)) {
+            PointerRun list = open;
+            open.count = 0;
+            if (!finish(list)) return;
+        }
+        for (const PointerRun& run : runs) {
+            if (open.count) open.count += run.count;
+            else open = run;
+            // A run that reaches the end of the chunk may continue into the next one (or the end of the ROM)
+            if (open.start + open.count == last) continue;
+            PointerRun list = open;
+            open.count = 0;
+            if (!finish(list)) return;
+        }
     }
+}
+
+// Searches a ROM image for offsets like searchForOffsets, but reports each list through a callback as
+// soon as it's confirmed (i.e. it matches exactly one type), in address order. The scan stops when the
+// callback returns false, or if stopWhenFound is set, once a sample list, an instrument list and a
+// module have been found. Modules are only checked against the current version's pattern format.
+// The result holds the lists found up to the point the scan stopped; if it stopped early, later lists
+// (which may include longer sample or instrument lists) and the signature may be missing.
+static OffsetSearchResult searchForOffsetsFast(const ConversionContext& ctx, const RomImage& rom, const std::function<bool(const OffsetCandidate&)>& callback, int threshold, bool stopWhenFound, bool verbose) {
+    OffsetSearchResult retval;
+    bool oldFormat = ctx.version < 0x20040707;
+    long signaturePos[SIGNATURE_COUNT];
+    scanPointerListsInOrder(rom, threshold, signaturePos, [&](const PointerRun& run)->bool {
+        PointerRun p = run;
+        p.type = (p.type & 0b0110) | (oldFormat ? p.type >> 3 : p.type & 1);
+        if (verbose) logMessage(stdout, "Found %d matches at %08X with type %s\n", (int)p.count, (uint32_t)p.start * 4, typemap[p.type]);
+        addCandidates(retval.candidates, p);
+        if (p.type != 1 && p.type != 2 && p.type != 4) return true;
+        uint32_t addr = p.start * 4;
+        if (p.type == 1) retval.modules.push_back(addr = (addr & 0x1ffffff) - 364);
+        else if (p.type == 2 && p.count > retval.sampleCount) {retval.sampleCount = p.count; retval.sampleAddr = addr;}
+        else if (p.type == 4 && p.count > retval.instrumentCount) {retval.instrumentCount = p.count; retval.instrumentAddr = addr;}
+        if (callback && !callback({addr, (uint32_t)p.count, p.type, 100})) return false;
+        return !(stopWhenFound && retval.sampleAddr && retval.instrumentAddr && !retval.modules.empty());
+    });
+    sortCandidates(retval.candidates);
 
+    retval.version = ctx.version;
+    retval.signatureFound = signaturePos[SIGNATURE_KRAWALL] >= 0;
+    if (retval.signatureFound && signaturePos[SIGNATURE_DATE] >= 0) retval.signatureVersion = readVersionDate(rom, signaturePos[SIGNATURE_DATE]);
+    else if (retval.signatureFound && signaturePos[SIGNATURE_VERSION_H] >= 0) retval.signatureVersion = readVersionDate(rom, signaturePos[SIGNATURE_VERSION_H]);
+    showOffsetSearchResult(retval);
     retval.success = retval.sampleAddr && !retval.modules.empty();
     return retval;
 }
 
+OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, FILE* fp, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false) {
+    RomImage rom(fp);
+    return searchForOffsetsFast(ctx, rom, callback, threshold, stopWhenFound, verbose);
+}
+
+OffsetSearchResult unkrawerter_searchForOffsets(FILE* fp, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false) {
+    return unkrawerter_searchForOffsets(defaultContext, fp, callback, threshold, stopWhenFound, verbose);
+}
+
+OffsetSearchResult unkrawerter_searchForOffsets(const ConversionContext& ctx, const uint8_t * data, size_t size, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false) {
+    RomImage rom(data, size);
+    return searchForOffsetsFast(ctx, rom, callback, threshold, stopWhenFound, verbose);
+}
+
+OffsetSearchResult unkrawerter_searchForOffsets(const uint8_t * data, size_t size, const std::function<bool(const OffsetCandidate&)>& callback, int threshold = 4, bool stopWhenFound = true, bool verbose = false) {
+    return unkrawerter_searchForOffsets(defaultContext, data, size, callback, threshold, stopWhenFound, verbose);
+}
+
+// Builds a reverse index of every pointer candidate in a ROM, as (target offset, referrer offset)
+// pairs sorted by target, so everything that points to an address can be found with a binary search.
+static std::vector<std::pair<uint32_t, uint32_t> > buildPointerIndex(const RomImage& rom) {
+    size_t words = rom.size() / 4;
+    std::vector<uint64_t> bits((words + 63) / 64);
+    if (words) findPointers(rom.data(), words, rom.size(), bits.data());
+    std::vector<std::pair<uint32_t, uint32_t> > index;
+    for (size_t w = 0; w < bits.size(); w++) {
+        for (uint64_t cur = bits[w]; cur; cur &= cur - 1) {
+            uint32_t pos = (w * 64 + ctz64(cur)) * 4;
+            index.push_back(std::make_pair(rom.u32(pos) & 0x1ffffff, pos));
+        }
+    }
+    std::sort(index.begin(), index.end());
+    return index;
+}
+
 // Reads a Krawall sample from a ROM and writes it to a WAV file
-void unkrawerter_readSampleToWAV(FILE* fp, uint32_t offset, const char * filename) {
-    fseek(fp, offset, SEEK_SET);
-    unsigned long loopLength = 0, end = 0;
-    fread(&loopLength, 4, 1, fp);
-    fread(&end, 4, 1, fp);
-    end &= 0x1ffffff;
-    unsigned long currentSize = end - ftell(fp) - 10;
+static void readSampleToWAV(const RomImage& rom, uint32_t offset, const char * filename) {
+    uint32_t end = rom.u32(offset + 4) & 0x1ffffff;
     FILE* wav = fopen(filename, "wb");
     fwrite("RIFF", 4, 1, wav);
-    unsigned long sampleRate = 0;
-    fread(&sampleRate, 4, 1, fp);
-    for (int i = 0; i < 6; i++) fgetc(fp);
-    unsigned long currentOffset = ftell(fp);
-    unsigned long size = end - currentOffset + 18;
+    uint32_t sampleRate = rom.u32(offset + 8);
+    uint32_t currentOffset = offset + 18;
+    uint32_t size = end - currentOffset + 18;
     fwrite(&size, 4, 1, wav);
     fwrite("WAVEfmt \x10\0\0\0\x01\0\x01\0", 16, 1, wav);
     fwrite(&sampleRate, 4, 1, wav);
@@ -224,12 +949,21 @@ void unkrawerter_readSampleToWAV(FILE* fp, uint32_t offset, const char * filenam
     fwrite("\x01\0\x08\0data", 8, 1, wav);
     size -= 36;
     fwrite(&size, 4, 1, wav);
-    char * data = (char*)malloc(size);
-    fread(data, 1, size, fp);
-    fwrite(data, 1, size, wav);
+    size_t avail = currentOffset < rom.size() ? std::min((size_t)size, rom.size() - currentOffset) : 0;
+    if (avail) fwrite(rom.view(currentOffset, avail), 1, avail, wav);
     fclose(wav);
 }
 
+void unkrawerter_readSampleToWAV(FILE* fp, uint32_t offset, const char * filename) {
+    RomImage rom(fp);
+    readSampleToWAV(rom, offset, filename);
+}
+
+void unkrawerter_readSampleToWAV(const uint8_t * data, size_t size, uint32_t offset, const char * filename) {
+    RomImage rom(data, size);
+    readSampleToWAV(rom, offset, filename);
+}
+
 // Taken from Krawall's mtypes.h file
 extern "C" {
 #ifdef _MSC_VER
@@ -318,99 +1052,331 @@ extern "C" {
 #endif
 }
 
-// Read a pattern from a file pointer to a Pattern structure pointer
-static Pattern * readPatternFile(FILE* fp, uint32_t offset, bool use2003format, bool isRipped) {
-    fseek(fp, offset + 32, SEEK_SET);
-    std::vector<uint8_t> fileContents;
+// Number of Krawall effects; EFF_VOLSLIDE_PORTA_XM (50) is the last one
+#define EFFECT_COUNT 51
+
+// Location & size of a pattern's packed data in a ROM image, found by scanning it in place without
+// copying or decoding anything. If the pattern runs past the end of the image (which only happens with
+// bad data), only the first `available` bytes are in it, and the rest read as 0.
+struct PatternView {
+    const uint8_t * data = NULL; // Packed cell data, after the header
+    uint32_t length = 0;         // Size of the packed cell data
+    uint32_t available = 0;      // Number of bytes of it that are in the ROM image
+    uint32_t cells = 0;          // Number of cells, not counting the 0 at the end of each row
     unsigned short rows = 0;
-    unsigned short s3mlength = 0;
-    if (use2003format && !isRipped) rows = fgetc(fp);
-    else fread(&rows, 2, 1, fp);
-    // We don't need to do full decoding; decode just enough to understand the size of the pattern
-    for (int row = 0; row < rows; row++) {
-        for (;;) {
-            unsigned char follow = fgetc(fp);
-            s3mlength++;
-            fileContents.push_back(follow);
-            if (!follow) break;
-            if (follow & 0x20) {
-                unsigned char note = fgetc(fp);
-                fileContents.push_back(note);
-                fileContents.push_back(fgetc(fp));
-                s3mlength += 2;
-                if (!use2003format && (note & 0x80)) fileContents.push_back(fgetc(fp));
-            }
-            if (follow & 0x40) {
-                fileContents.push_back(fgetc(fp));
-                s3mlength++;
+    unsigned short s3mlength = 0; // Size of the pattern in S3M packed format
+};
+
+// Number of bytes following each possible channel/follow byte in a packed cell: 2 for a note & instrument,
+// 1 for a volume and 2 for an effect. The S3M packed format uses the same sizes. The extra instrument
+// byte used by the 2004-07-07+ format depends on the note, so it isn't counted here.
+static const unsigned char followPayloadSize[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+};
+
+// Finds a pattern's data in a ROM image & works out its size. The format is fixed at compile time, and a
+// cell's size comes from the table, so the only branches left are the end of each row and the bounds check.
+template<bool use2003format>
+static PatternView scanPattern(const RomImage& rom, uint32_t offset, bool isRipped) {
+    PatternView view;
+    uint32_t pos = offset + 32;
+    if (use2003format && !isRipped) view.rows = rom.u8(pos++);
+    else {view.rows = rom.u16(pos); pos += 2;}
+    view.data = rom.view(pos, 0);
+    view.available = view.data ? rom.size() - (pos & 0x1ffffff) : 0;
+    const uint8_t * data = view.data;
+    const uint32_t available = view.available;
+    auto at = [data, available](uint32_t i)->uint8_t {return i < available ? data[i] : 0;};
+    uint32_t i = 0, cells = 0, longInstruments = 0;
+    for (unsigned row = 0; row < view.rows;) {
+        unsigned char follow = at(i);
+        if (!follow) { // End of the row; empty rows are common, so this is cheaper as a branch
+            i++;
+            row++;
+            continue;
+        }
+        if (!use2003format) { // The instrument takes 2 bytes if the high bit of the note is set
+            unsigned longInstrument = (follow >> 5) & (at(i + 1) >> 7) & 1;
+            longInstruments += longInstrument;
+            i += longInstrument;
+        }
+        i += 1 + followPayloadSize[follow];
+        cells++;
+    }
+    view.length = i;
+    view.cells = cells;
+    view.s3mlength = i - longInstruments; // Every byte but the extra instrument bytes has a counterpart in S3M
+    view.available = std::min(view.available, view.length);
+    return view;
+}
+
+static PatternView scanPattern(const RomImage& rom, uint32_t offset, bool use2003format, bool isRipped) {
+    return use2003format ? scanPattern<true>(rom, offset, isRipped) : scanPattern<false>(rom, offset, isRipped);
+}
+
+// A pattern decoded from Krawall's packed format. Every field of the cells is kept in its own array, with
+// the cells in the order they're stored, and rowStart holds the index of each row's first cell followed by
+// the number of cells. The cells aren't placed in a grid by channel, since the S3M writer copies them in
+// order and some fixes in the XM writer depend on that order. Fields a cell doesn't have are 0.
+// The arrays belong to the ModuleData the pattern was read into.
+struct DecodedPattern {
+    unsigned short rows = 0;
+    unsigned short s3mlength = 0;               // Size of the pattern in S3M packed format
+    const uint32_t * rowStart = &noCells;
+    const unsigned char * follow = NULL;        // Channel in the low 5 bits, then 0x20 = note & instrument, 0x40 = volume, 0x80 = effect
+    const unsigned char * note = NULL;
+    const unsigned short * instrument = NULL;
+    const unsigned char * volume = NULL;
+    const unsigned char * effect = NULL;
+    const unsigned char * effectop = NULL;
+
+    static const uint32_t noCells;
+};
+const uint32_t DecodedPattern::noCells = 0;
+
+// Decodes a pattern's cells into zeroed arrays with room for view.rows + 1 row starts, view.cells
+// instruments and view.cells * 5 bytes. This is the only place the packed cell format is parsed; all of
+// the writers work from the decoded pattern.
+template<bool use2003format>
+static DecodedPattern decodePattern(const PatternView& view, uint32_t * rowStart, unsigned short * instrument, unsigned char * bytes) {
+    DecodedPattern retval;
+    unsigned char * follow = bytes, * note = bytes + view.cells, * volume = bytes + view.cells * 2, * effect = bytes + view.cells * 3, * effectop = bytes + view.cells * 4;
+    retval.rows = view.rows;
+    retval.s3mlength = view.s3mlength;
+    retval.rowStart = rowStart;
+    retval.follow = follow;
+    retval.note = note;
+    retval.instrument = instrument;
+    retval.volume = volume;
+    retval.effect = effect;
+    retval.effectop = effectop;
+    // The scan already found where the pattern ends, so the data can be read without checking bounds,
+    // unless it runs past the end of the ROM image; then it's read from a copy padded with 0s
+    std::vector<uint8_t> padded;
+    const uint8_t * data = view.data;
+    if (view.available < view.length) {
+        padded.resize(view.length);
+        if (view.available) memcpy(padded.data(), view.data, view.available);
+        data = padded.data();
+    }
+    uint32_t c = 0;
+    rowStart[0] = 0;
+    for (int row = 0; row < view.rows; row++) {
+        // Read the channel/next byte types; if it's 0, the row's done
+        for (unsigned char f = *data++; f; f = *data++, c++) {
+            follow[c] = f;
+            if (f & 0x20) { // Note & instrument follows
+                unsigned char n = *data++;
+                unsigned short ins = *data++;
+                if (use2003format) { // For versions before 2004-07-07, note is high 7 bits & instrument is low 9 bits
+                    ins |= (n & 1) << 8;
+                    n >>= 1;
+                } else if (n & 0x80) { // For versions starting with 2004-07-07, if the note > 128, the instrument field is 2 bytes long
+                    ins |= *data++ << 8;
+                    n &= 0x7f;
+                }
+                note[c] = n;
+                instrument[c] = ins;
             }
-            if (follow & 0x80) {
-                fileContents.push_back(fgetc(fp));
-                fileContents.push_back(fgetc(fp));
-                s3mlength += 2;
+            if (f & 0x40) volume[c] = *data++; // Volume follows
+            if (f & 0x80) { // Effect follows
+                effect[c] = data[0];
+                effectop[c] = data[1];
+                data += 2;
             }
         }
+        rowStart[row + 1] = c;
     }
-    fseek(fp, offset, SEEK_SET);
-    Pattern * retval = (Pattern*)malloc(38 + fileContents.size());
-    retval->s3mlength = s3mlength;
-    retval->length = fileContents.size();
-    fread(retval->index, 2, 16, fp);
-    fseek(fp, 2, SEEK_CUR);
-    retval->rows = rows;
-    memcpy(retval->data, &fileContents[0], fileContents.size());
     return retval;
 }
 
-// Read a module from a file pointer to a Module structure pointer
+// A module read from a ROM image, with all of its patterns decoded
+// The decoded cells of every pattern are stored together, so reading a module takes a fixed number of
+// allocations no matter how many patterns it has.
+struct ModuleData {
+    Module header; // header.patterns isn't used
+    std::vector<DecodedPattern> patterns;
+    std::vector<uint32_t> rowStarts;
+    std::vector<unsigned short> instruments;
+    std::vector<unsigned char> cellBytes;
+};
+
+// Reads & decodes all of a module's patterns in one format
+template<bool use2003format>
+static void readModulePatterns(const RomImage& rom, uint32_t offset, int maxPattern, ModuleData& module) {
+    // Find all of the patterns first, so the space for their cells can be allocated in one go
+    PatternView views[256];
+    int patternCount = 0;
+    size_t rows = 0, cells = 0;
+    for (; patternCount <= maxPattern; patternCount++) {
+        uint32_t addr = rom.u32(offset + 364 + patternCount*4);
+        if ((offset != 4 && !(addr & 0x08000000)) || (addr & 0xf6000000)) break;
+        views[patternCount] = scanPattern<use2003format>(rom, addr & 0x1ffffff, offset == 4);
+        rows += views[patternCount].rows + 1;
+        cells += views[patternCount].cells;
+    }
+    module.patterns.resize(maxPattern + 1);
+    module.rowStarts.resize(rows);
+    module.instruments.resize(cells);
+    module.cellBytes.resize(cells * 5);
+    rows = cells = 0;
+    for (int i = 0; i < patternCount; i++) {
+        module.patterns[i] = decodePattern<use2003format>(views[i], module.rowStarts.data() + rows, module.instruments.data() + cells, module.cellBytes.data() + cells * 5);
+        rows += views[i].rows + 1;
+        cells += views[i].cells;
+    }
+}
+
+// Read a module from a ROM image
 // This reads all its patterns as well
-static Module * readModuleFile(FILE* fp, uint32_t offset) {
-    Module * retval = (Module*)malloc(sizeof(Module));
-    memset(retval, 0, sizeof(Module));
-    fseek(fp, offset, SEEK_SET);
-    fread(retval, 364, 1, fp);
+static ModuleData readModuleFile(const ConversionContext& ctx, const RomImage& rom, uint32_t offset) {
+    ModuleData retval;
+    memset(&retval.header, 0, sizeof(Module));
+    rom.copy(&retval.header, offset, 364);
     unsigned char maxPattern = 0;
-    for (int i = 0; i < retval->numOrders; i++) if (retval->order[i] != 254) maxPattern = std::max(maxPattern, retval->order[i]);
-    Module * retval2 = (Module*)malloc(sizeof(Module) + sizeof(Pattern*) * (maxPattern + 1));
-    memcpy(retval2, retval, sizeof(Module));
-    uint32_t addr = 0;
-    for (int i = 0; i <= maxPattern; i++) {
-        fseek(fp, offset + 364 + i*4, SEEK_SET);
-        fread(&addr, 4, 1, fp);
-        if (offset != 4 && !(addr & 0x08000000) || (addr & 0xf6000000)) break;
-        retval2->patterns[i] = readPatternFile(fp, addr & 0x1ffffff, version < 0x20040707, offset == 4);
-    }
-    return retval2;
-}
-
-// Read an instrument from a file pointer to an Instrument structure
-static Instrument readInstrumentFile(FILE* fp, uint32_t offset) {
-    fseek(fp, offset, SEEK_SET);
+    for (int i = 0; i < retval.header.numOrders; i++) if (retval.header.order[i] != 254) maxPattern = std::max(maxPattern, retval.header.order[i]);
+    if (ctx.version < 0x20040707) readModulePatterns<true>(rom, offset, maxPattern, retval);
+    else readModulePatterns<false>(rom, offset, maxPattern, retval);
+    return retval;
+}
+
+// Checks whether a pattern decodes cleanly: every row must have at most one cell per channel, and every
+// cell must be on one of the module's channels, use an instrument (or sample) number up to maxInstrument
+// and a known effect, and the data must end inside the ROM. The pattern is decoded into scratch's arrays.
+template<bool use2003format>
+static bool validatePattern(const RomImage& rom, uint32_t offset, int channels, uint32_t maxInstrument, ModuleData& scratch) {
+    if (rom.u8(offset) || rom.u8(offset + 1) || rom.u8(offset + 3)) return false;
+    // Check the row count before scanning, so garbage doesn't get scanned for thousands of rows
+    unsigned short rows = use2003format ? rom.u8(offset + 32) : rom.u16(offset + 32);
+    if (rows == 0 || rows > 256 || (rows & 7)) return false;
+    PatternView view = scanPattern<use2003format>(rom, offset, false);
+    if (view.available < view.length || view.cells > (uint32_t)channels * rows) return false;
+    scratch.rowStarts.resize(rows + 1);
+    scratch.instruments.assign(view.cells, 0);
+    scratch.cellBytes.assign(view.cells * 5, 0);
+    DecodedPattern pat = decodePattern<use2003format>(view, scratch.rowStarts.data(), scratch.instruments.data(), scratch.cellBytes.data());
+    for (int row = 0; row < rows; row++) {
+        if (pat.rowStart[row + 1] - pat.rowStart[row] > (uint32_t)channels) return false;
+        for (uint32_t c = pat.rowStart[row]; c < pat.rowStart[row + 1]; c++) {
+            if ((pat.follow[c] & 0x1f) >= channels) return false;
+            if ((pat.follow[c] & 0x20) && pat.instrument[c] > maxInstrument) return false;
+            if ((pat.follow[c] & 0x80) && pat.effect[c] >= EFFECT_COUNT) return false;
+        }
+    }
+    return true;
+}
+
+// Checks whether there's a module at an offset: the header must be sane, every order must refer to
+// one of the module's patterns, and every pattern must decode cleanly with instrument numbers that
+// fit in the instrument (or sample) list.
+static bool validateModule(const RomImage& rom, uint32_t offset, bool oldFormat, uint32_t sampleCount, uint32_t instrumentCount) {
+    int channels = rom.u8(offset), numOrders = rom.u8(offset + 1);
+    if (channels == 0 || channels > 32 || numOrders == 0) return false;
+    uint32_t pos = offset + 356;
+    if (rom.u8(pos) == 0 || rom.u8(pos) > 0x10 || rom.u8(pos + 1) < 30) return false; // initSpeed, initBPM
+    for (int i = 0; i < 5; i++) if (rom.u8(pos + 2 + i) & 0xfe) return false; // flags
+    if (rom.u8(pos + 7)) return false;
+    bool instrumentBased = rom.u8(pos + 2);
+    if (instrumentBased && !instrumentCount) return false;
+    uint32_t patternCount = 0;
+    while (patternCount < POINTER_LIST_MAX && isPointerCandidate(rom.u32(offset + 364 + patternCount * 4), rom.size())) patternCount++;
+    if (patternCount == 0 || patternCount == POINTER_LIST_MAX) return false;
+    for (int i = 0; i < numOrders; i++) {
+        uint8_t order = rom.u8(offset + 3 + i);
+        if (order >= patternCount && order < 254) return false;
+    }
+    uint32_t maxInstrument = instrumentBased ? instrumentCount : sampleCount;
+    ModuleData scratch;
+    for (uint32_t i = 0; i < patternCount; i++) {
+        uint32_t addr = rom.u32(offset + 364 + i * 4) & 0x1ffffff;
+        bool valid = oldFormat ? validatePattern<true>(rom, addr, channels, maxInstrument, scratch) : validatePattern<false>(rom, addr, channels, maxInstrument, scratch);
+        if (!valid) return false;
+    }
+    return true;
+}
+
+// Discovers modules that the threshold search can't find (e.g. ones with only 1-3 patterns) by
+// following references instead: every module is pointed to from somewhere (usually the game's song
+// table or code), so each pointer target is checked for a module header followed by patterns that
+// decode cleanly using the sample/instrument lists from a previous search.
+// Returns the offsets of all modules found that aren't already in the search results.
+static std::vector<uint32_t> discoverModules(const ConversionContext& ctx, const RomImage& rom, const OffsetSearchResult& offsets, bool verbose) {
+    std::vector<uint32_t> retval;
+    if (!offsets.sampleAddr) return retval;
+    bool oldFormat = ctx.version < 0x20040707;
+    std::vector<std::pair<uint32_t, uint32_t> > index = buildPointerIndex(rom);
+    for (size_t i = 0; i < index.size(); i++) {
+        uint32_t target = index[i].first;
+        if (i > 0 && index[i-1].first == target) continue; // Only check each target once
+        if ((target & 3) || std::find(offsets.modules.begin(), offsets.modules.end(), target) != offsets.modules.end()) continue;
+        if (!validateModule(rom, target, oldFormat, offsets.sampleCount, offsets.instrumentCount)) continue;
+        retval.push_back(target);
+        if (verbose) logMessage(stdout, "Module at %08X is referenced from %08X\n", target, index[i].second);
+        logMessage(stdout, "> Discovered module at address %08X\n", target);
+    }
+    return retval;
+}
+
+std::vector<uint32_t> unkrawerter_discoverModules(const ConversionContext& ctx, FILE* fp, const OffsetSearchResult& offsets, bool verbose = false) {
+    RomImage rom(fp);
+    return discoverModules(ctx, rom, offsets, verbose);
+}
+
+std::vector<uint32_t> unkrawerter_discoverModules(FILE* fp, const OffsetSearchResult& offsets, bool verbose = false) {
+    return unkrawerter_discoverModules(defaultContext, fp, offsets, verbose);
+}
+
+std::vector<uint32_t> unkrawerter_discoverModules(const ConversionContext& ctx, const uint8_t * data, size_t size, const OffsetSearchResult& offsets, bool verbose = false) {
+    RomImage rom(data, size);
+    return discoverModules(ctx, rom, offsets, verbose);
+}
+
+std::vector<uint32_t> unkrawerter_discoverModules(const uint8_t * data, size_t size, const OffsetSearchResult& offsets, bool verbose = false) {
+    return unkrawerter_discoverModules(defaultContext, data, size, offsets, verbose);
+}
+
+// Read an instrument from a ROM image to an Instrument structure
+static Instrument readInstrumentFile(const RomImage& rom, uint32_t offset) {
     Instrument retval;
-    fread(&retval, sizeof(retval), 1, fp);
+    rom.copy(&retval, offset, sizeof(retval));
     // There's a chance that one of the high bytes in the sample number list gets set to some random (?) value
     // I've experienced this in Cocoto games, where one of the high notes' samples has the low byte the same as the others,
     // but the high byte is set to some really high value (like 0x98).
     // I'm not sure why this is, but we'll try to fix it anyway.
-    for (int i = 0; i < 96; i++) {
-        if ((retval.samples[i] & 0xff00) != 0 && (i > 0 ? (retval.samples[i] & 0xff) == (retval.samples[i-1] & 0xff) : true) && (i < 95 ? (retval.samples[i] & 0xff) == (retval.samples[i+1] & 0xff) : true)) {
-            retval.samples[i] &= 0xff;
+    SampleMapInfo info = checkSampleMap((const uint8_t*)retval.samples);
+    for (int w = 0; w < 2; w++) {
+        for (uint64_t high = info.highBytes[w]; high; high &= high - 1) {
+            int i = w * 64 + ctz64(high);
+            if ((i > 0 ? (retval.samples[i] & 0xff) == (retval.samples[i-1] & 0xff) : true) && (i < 95 ? (retval.samples[i] & 0xff) == (retval.samples[i+1] & 0xff) : true)) {
+                retval.samples[i] &= 0xff;
+            }
         }
     }
     return retval;
 }
 
-// Read a sample from a file pointer to a Sample structure pointer
-static Sample * readSampleFile(FILE* fp, uint32_t offset) {
-    fseek(fp, offset + 4, SEEK_SET);
-    uint32_t size = 0;
-    fread(&size, 4, 1, fp);
+// Read a sample from a ROM image to a Sample structure pointer
+static Sample * readSampleFile(const RomImage& rom, uint32_t offset) {
+    uint32_t size = rom.u32(offset + 4);
     size &= 0x1ffffff;
     size -= offset;
-    fseek(fp, offset, SEEK_SET);
     Sample * retval = (Sample*)malloc(size);
-    memset(retval, 0, size);
-    fread(retval, size, 1, fp);
+    rom.copy(retval, offset, size);
     retval->size = size - 18;
     return retval;
 }
@@ -425,21 +1391,116 @@ typedef struct {
 // Quick function to repeatedly put a character
 inline void fputcn(int c, int num, FILE* fp) {for (; num > 0; num--) fputc(c, fp);}
 
-// Effect map to convert Krawall effects to XM effects
-// (effect . effectop) = first | (effectop & second)
-// If first == 0xFFFF: ignore
-// Some effects must be converted from S3M syntax to XM syntax.
-// Some effects are only supported in S3M files, and are not converted.
-// Some effects are only supported in MPT/OpenMPT, and may not play properly on other trackers.
-const std::pair<unsigned short, unsigned char> effectMap_xm[] = {
-    {0xFFFF, 0xFF}, 
-    {0x0F00, 0xFF},       // EFF_SPEED
-    {0x0F00, 0xFF},       // EFF_BPM
-    {0x0F00, 0xFF},       // EFF_SPEEDBPM
-    {0x0B00, 0xFF},       // EFF_PATTERN_JUMP
-    {0x0D00, 0xFF},       // EFF_PATTERN_BREAK				5
-    {0x0A00, 0xFF},       // EFF_VOLSLIDE_S3M               (S3M!)
-    {0x0A00, 0xFF},       // EFF_VOLSLIDE_XM
+// Opens a file to write a converted module to; the file name "-" writes to stdout instead,
+// which may be a pipe, so modules are always written front to back without seeking
+static FILE* openOutputFile(const char * filename) {
+    if (strcmp(filename, "-") != 0) return fopen(filename, "wb");
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    stdoutHasData = true;
+    return stdout;
+}
+
+// Closes a file from openOutputFile, returning 0 on success
+static int closeOutputFile(FILE* fp) {
+    return fp == stdout ? fflush(fp) : fclose(fp);
+}
+
+// Growable in-memory output file. Files are built up here and written with one call,
+// which avoids the overhead of stdio for every byte, and sizes that are only known
+// later can be patched in by offset instead of seeking back in the file.
+class ByteWriter {
+public:
+    size_t tell() const {return buf.size();}
+    const uint8_t * data() const {return buf.data();}
+
+    void put(uint8_t c) {buf.push_back(c);}
+    void putn(uint8_t c, size_t num) {buf.insert(buf.end(), num, c);}
+    void write(const void * data, size_t size) {buf.insert(buf.end(), (const uint8_t*)data, (const uint8_t*)data + size);}
+    void u16(uint16_t v) {write(&v, 2);}
+    void u32(uint32_t v) {write(&v, 4);}
+    // Adds space for `size` bytes, returning a pointer to fill them in (only valid until the next write)
+    uint8_t * append(size_t size) {buf.resize(buf.size() + size); return buf.data() + buf.size() - size;}
+
+    // Overwrites bytes that were already written
+    void patch16(size_t pos, uint16_t v) {memcpy(&buf[pos], &v, 2);}
+    void patch32(size_t pos, uint32_t v) {memcpy(&buf[pos], &v, 4);}
+    void fill(size_t pos, uint8_t c, size_t num) {memset(&buf[pos], c, num);}
+
+    // Writes everything to a file, returning whether it was all written
+    bool writeTo(FILE* fp) const {return fwrite(buf.data(), 1, buf.size(), fp) == buf.size();}
+
+private:
+    std::vector<uint8_t> buf;
+};
+
+// The delta kernels below convert signed 8-bit sample data to XM's format: unsigned, with each sample
+// stored as the difference from the previous one. Since the difference between two samples is the same
+// whether they're signed or unsigned, only the first one needs converting, and every other byte is just
+// the difference from the byte before it. All of them must produce identical results.
+typedef void (*DeltaKernel)(const int8_t * src, size_t size, uint8_t * dest);
+
+static void deltaEncode_scalar(const int8_t * src, size_t size, uint8_t * dest) {
+    unsigned char old = 0;
+    for (size_t i = 0; i < size; i++) {
+        dest[i] = ((int)src[i] + 0x80) - old;
+        old = (int)src[i] + 0x80;
+    }
+}
+
+#ifdef UNKRAWERTER_USE_SSE2
+static void deltaEncode_sse2(const int8_t * src, size_t size, uint8_t * dest) {
+    if (size <= 16) return deltaEncode_scalar(src, size, dest); // Too short to fill a vector
+    dest[0] = src[0] + 0x80;
+    size_t i = 1;
+    for (; i + 16 <= size; i += 16)
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(src + i)), _mm_loadu_si128((const __m128i*)(src + i - 1))));
+    for (; i < size; i++) dest[i] = src[i] - src[i - 1];
+}
+#endif
+
+#ifdef UNKRAWERTER_USE_AVX2
+__attribute__((target("avx2"))) static void deltaEncode_avx2(const int8_t * src, size_t size, uint8_t * dest) {
+    if (size <= 32) return deltaEncode_scalar(src, size, dest); // Too short to fill a vector
+    dest[0] = src[0] + 0x80;
+    size_t i = 1;
+    for (; i + 32 <= size; i += 32)
+        _mm256_storeu_si256((__m256i*)(dest + i), _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(src + i)), _mm256_loadu_si256((const __m256i*)(src + i - 1))));
+    for (; i < size; i++) dest[i] = src[i] - src[i - 1];
+}
+#endif
+
+// Picks the fastest delta kernel the CPU supports
+static DeltaKernel selectDeltaKernel() {
+#ifdef UNKRAWERTER_USE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return deltaEncode_avx2;
+#endif
+#ifdef UNKRAWERTER_USE_SSE2
+    return deltaEncode_sse2;
+#else
+    return deltaEncode_scalar;
+#endif
+}
+
+static const DeltaKernel deltaEncode = selectDeltaKernel();
+
+// Effect map to convert Krawall effects to XM effects
+// (effect . effectop) = first | (effectop & second)
+// If first == 0xFFFF: ignore
+// Some effects must be converted from S3M syntax to XM syntax.
+// Some effects are only supported in S3M files, and are not converted.
+// Some effects are only supported in MPT/OpenMPT, and may not play properly on other trackers.
+const std::pair<unsigned short, unsigned char> effectMap_xm[EFFECT_COUNT] = {
+    {0xFFFF, 0xFF}, 
+    {0x0F00, 0xFF},       // EFF_SPEED
+    {0x0F00, 0xFF},       // EFF_BPM
+    {0x0F00, 0xFF},       // EFF_SPEEDBPM
+    {0x0B00, 0xFF},       // EFF_PATTERN_JUMP
+    {0x0D00, 0xFF},       // EFF_PATTERN_BREAK				5
+    {0x0A00, 0xFF},       // EFF_VOLSLIDE_S3M               (S3M!)
+    {0x0A00, 0xFF},       // EFF_VOLSLIDE_XM
     {0x0EB0, 0x0F},       // EFF_VOLSLIDE_DOWN_XM_FINE
     {0x0EA0, 0x0F},       // EFF_VOLSLIDE_UP_XM_FINE
     {0x0200, 0xFF},       // EFF_PORTA_DOWN_XM				10
@@ -486,7 +1547,7 @@ const std::pair<unsigned short, unsigned char> effectMap_xm[] = {
 };
 
 // Same for S3M effects
-const std::pair<unsigned short, unsigned char> effectMap_s3m[] = {
+const std::pair<unsigned short, unsigned char> effectMap_s3m[EFFECT_COUNT] = {
     {0xFF00, 0x00}, 
     {0x0100, 0xFF},       //  A: EFF_SPEED
     {0x1400, 0xFF},       //  T: EFF_BPM
@@ -548,23 +1609,24 @@ struct channel_memory {
     unsigned short instrument;
 };
 
-// Writes a module from a file pointer to a new XM file.
+// Writes a module from a ROM image to a new XM file.
 // XM file format from http://web.archive.org/web/20060809013752/http://pipin.tmd.ns.ac.yu/extra/fileformat/modules/xm/xm.txt
-int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, bool fixCompatibility = true, FILE* instfp = NULL) {
-    if (instfp == NULL) instfp = fp;
+// Samples and instruments are read from instrom, which is the same as rom unless a bank is used.
+static int writeModuleToXM(const ConversionContext& ctx, const RomImage& rom, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename, bool trimInstruments, const char * name, bool fixCompatibility, const RomImage& instrom) {
     // Die if there are too many instruments for XM & we're not trimming instruments
     if (instrumentOffsets.size() > 255 && !trimInstruments) {
-        fprintf(stderr, "Error: This module cannot be ripped without trimming instruments.\n");
+        logMessage(stderr, "Error: This module cannot be ripped without trimming instruments.\n");
         return 10;
     }
     // Open the XM file
-    FILE* out = fopen(filename, "wb");
-    if (out == NULL) {
-        fprintf(stderr, "Error: Could not open output file %s for writing.\n", filename);
+    FILE* fp = openOutputFile(filename);
+    if (fp == NULL) {
+        logMessage(stderr, "Error: Could not open output file %s for writing.\n", filename);
         return 2;
     }
     // Read the module from the file
-    Module * mod = readModuleFile(fp, moduleOffset);
+    ModuleData module = readModuleFile(ctx, rom, moduleOffset);
+    Module * mod = &module.header;
     int markerAdd = 0;
     for (int i = 0; i < mod->numOrders; i++) {
         mod->order[i] = mod->order[i+markerAdd];
@@ -575,50 +1637,50 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
     for (int i = 0; i < mod->numOrders; i++) patternCount = std::max(patternCount, mod->order[i]);
     patternCount++;
     if (mod->flagInstrumentBased && instrumentOffsets.empty()) {
-        fprintf(stderr, "Error: Could not find all of the offsets required.\n * Does the ROM use the Krawall engine?\n * Try adjusting the search threshold.\n * You may need to find offsets yourself.\n");
-        for (int i = 0; i < patternCount; i++) free((void*)mod->patterns[i]);
-        free(mod);
-        fclose(out);
+        logMessage(stderr, "Error: Could not find all of the offsets required.\n * Does the ROM use the Krawall engine?\n * Try adjusting the search threshold.\n * You may need to find offsets yourself.\n");
+        closeOutputFile(fp);
         return 3;
     }
     // Write the XM header info
-    if (name == NULL) fwrite("Extended Module: Krawall conversion  \032UnkrawerterGBA      \x04\x01\x14\x01\0\0", 1, 64, out);
+    ByteWriter out;
+    if (name == NULL) out.write("Extended Module: Krawall conversion  \032UnkrawerterGBA      \x04\x01\x14\x01\0\0", 64);
     else {
-        fwrite("Extended Module: ", 1, 17, out);
-        fwrite(name, 1, std::min(strlen(name), (size_t)20), out);
-        for (int i = std::min(strlen(name), (size_t)20); i < 20; i++) fputc(' ', out);
-        fwrite("\032UnkrawerterGBA      \x04\x01\x14\x01\0\0", 1, 27, out);
-    }
-    fputc(mod->numOrders, out);
-    fputc(0, out); // 1-byte padding
-    fputc(mod->songRestart, out);
-    fputc(0, out); // 1-byte padding
-    fputc(mod->channels, out);
-    fputc(0, out); // 2-byte padding
+        out.write("Extended Module: ", 17);
+        out.write(name, std::min(strlen(name), (size_t)20));
+        for (int i = std::min(strlen(name), (size_t)20); i < 20; i++) out.put(' ');
+        out.write("\032UnkrawerterGBA      \x04\x01\x14\x01\0\0", 27);
+    }
+    out.put(mod->numOrders);
+    out.put(0); // 1-byte padding
+    out.put(mod->songRestart);
+    out.put(0); // 1-byte padding
+    out.put(mod->channels);
+    out.put(0); // 2-byte padding
     unsigned short pnum = patternCount;
-    fwrite(&pnum, 2, 1, out);
-    uint32_t instrumentSizePos = ftell(out); // we'll get back to this later
-    if (trimInstruments) fputcn(0, 2, out);
-    else {pnum = mod->flagInstrumentBased ? instrumentOffsets.size() : sampleOffsets.size(); fwrite(&pnum, 2, 1, out);}
-    fputc((mod->flagLinearSlides ? 1 : 0), out);
-    fputc(0, out); // 2-byte padding
-    fputc(mod->initSpeed, out);
-    fputc(0, out); // 2-byte padding
-    fputc(mod->initBPM, out);
-    fputc(0, out); // 2-byte padding
-    fwrite(mod->order, 1, 256, out);
+    out.u16(pnum);
+    uint32_t instrumentSizePos = out.tell(); // we'll get back to this later
+    if (trimInstruments) out.putn(0, 2);
+    else {pnum = mod->flagInstrumentBased ? instrumentOffsets.size() : sampleOffsets.size(); out.u16(pnum);}
+    out.put((mod->flagLinearSlides ? 1 : 0));
+    out.put(0); // 2-byte padding
+    out.put(mod->initSpeed);
+    out.put(0); // 2-byte padding
+    out.put(mod->initBPM);
+    out.put(0); // 2-byte padding
+    out.write(mod->order, 256);
     std::vector<unsigned short> instrumentList; // used to hold the instruments used so we can remove unnecessary instruments
+    std::vector<unsigned char> instrumentRemap(trimInstruments ? 0x10000 : 0); // XM instrument number for each Krawall instrument (minus 1), or 0 if not used yet
     std::map<unsigned short, std::vector<std::pair<unsigned char, unsigned long> > > sampleOffsetList; // used to hold on to sample offset effects that may need fixing
     // Write each pattern
     for (int i = 0; i < patternCount; i++) {
+        const DecodedPattern& pat = module.patterns[i];
         // Write pattern header
-        fputc(9, out);
-        fputcn(0, 4, out); // 4-byte padding + packing type (always 0)
-        fwrite(&mod->patterns[i]->rows, 2, 1, out);
-        uint32_t sizePos = ftell(out); // Save the position so we can come back to write the size
-        fputcn(0, 2, out); // placeholder, we'll come back to this
+        out.put(9);
+        out.putn(0, 4); // 4-byte padding + packing type (always 0)
+        out.u16(pat.rows);
+        uint32_t sizePos = out.tell(); // Save the position so we can come back to write the size
+        out.putn(0, 2); // placeholder, we'll come back to this
         // Convert the Krawall data into XM data
-        const unsigned char * data = mod->patterns[i]->data;
         Note * thisrow = (Note*)calloc(mod->channels, sizeof(Note)); // stores the current row's notes
         unsigned char warnings = 0; // for S3M/MPT warnings, we only warn once per pattern
         struct channel_memory * memory = new struct channel_memory[mod->channels]; // to store memory for various patches
@@ -629,40 +1691,32 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
             memory[i].instrument = 0;
         }
         unsigned char speed = mod->initSpeed; // to help portamento
-        for (int row = 0; row < mod->patterns[i]->rows; row++) {
+        for (int row = 0; row < pat.rows; row++) {
             memset(thisrow, 0, sizeof(Note) * mod->channels); // Zero so we can check the values for 0 later
-            for (;;) {
-                // Read the channel/next byte types
-                unsigned char follow = *data++;
-                if (!follow) break; // If it's 0, the row's done
+            for (uint32_t c = pat.rowStart[row]; c < pat.rowStart[row + 1]; c++) {
+                unsigned char follow = pat.follow[c];
                 unsigned char xmflag = 0x80; // Stores the next byte types in XM format
                 int channel = follow & 0x1f;
                 unsigned char note = 0, volume = 0, effect = 0, effectop = 0;
                 unsigned short instrument = 0;
                 if (follow & 0x20) { // Note & instrument follows
                     xmflag |= 0x03;
-                    note = *data++;
-                    instrument = *data++;
-                    if (version < 0x20040707) { // For versions before 2004-07-07, note is high 7 bits & instrument is low 9 bits
-                        instrument |= (note & 1) << 8;
-                        note >>= 1;
-                    } else if (note & 0x80) { // For versions starting with 2004-07-07, if the note > 128, the instrument field is 2 bytes long
-                        instrument |= *data++ << 8;
-                        note &= 0x7f;
-                    }
+                    note = pat.note[c];
+                    instrument = pat.instrument[c];
                     if (note > 97 || note == 0) note = 97;
                 }
                 if (follow & 0x40) { // Volume follows
                     xmflag |= 0x04;
-                    volume = *data++;
+                    volume = pat.volume[c];
                 }
                 if (follow & 0x80) { // Effect follows
                     xmflag |= 0x18;
-                    effect = *data++;
-                    effectop = *data++;
+                    effect = pat.effect[c];
+                    effectop = pat.effectop[c];
                     // Convert the Krawall effect into an XM effect
-                    unsigned short xmeffect = effectMap_xm[effect].first;
-                    unsigned char effectmask = effectMap_xm[effect].second;
+                    // Effects past the end of the map (only in bad data) are ignored like effect 0
+                    unsigned short xmeffect = effectMap_xm[effect < EFFECT_COUNT ? effect : 0].first;
+                    unsigned char effectmask = effectMap_xm[effect < EFFECT_COUNT ? effect : 0].second;
                     if (xmeffect == 0xFFFF) { // Ignored
                         xmflag &= ~0x18;
                         effect = 0;
@@ -734,13 +1788,13 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
                             effect = 0x06;
                         }
                     } else if (effect == 25 || effect == 26 || effect == 31 || (effect == 1 && (effectop >= 0x20 || effectop == 0))) { // Unsupported S3M effects
-                        if (!(warnings & 0x02) && !(effect == 1 && effectop == 0)) {warnings |= 0x02; fprintf(stderr, "Warning: Pattern %d uses an S3M effect that isn't compatible with XM. It will not play correctly.\n", i);}
+                        if (!(warnings & 0x02) && !(effect == 1 && effectop == 0)) {warnings |= 0x02; logMessage(stderr, "Warning: Pattern %d uses an S3M effect that isn't compatible with XM. It will not play correctly.\n", i);}
                         xmflag &= ~0x18;
                         effect = 0;
                         effectop = 0;
                     } else { // Other effects
                         // Warn if MPT-only
-                        if ((effect == 35 || effect == 40) && !(warnings & 0x01)) {warnings |= 0x01; fprintf(stderr, "Warning: Pattern %d uses an effect specific to OpenMPT. It may not play correctly in other trackers.\n", i);}
+                        if ((effect == 35 || effect == 40) && !(warnings & 0x01)) {warnings |= 0x01; logMessage(stderr, "Warning: Pattern %d uses an effect specific to OpenMPT. It may not play correctly in other trackers.\n", i);}
                         if (effect == 1 || effect == 3) speed = effectop;
                         if (effect == 29 && (effectop & 0xF0) == 0x00) effectop |= 0x80;
                         xmeffect = xmeffect | (effectop & effectmask);
@@ -812,7 +1866,7 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
                                 volume = 0xC0 | (memory[channel].pan >> 4);
                             } else {
                                 // Otherwise, both volume and effect columns are in use so we can't fix the panning. Oh well.
-                                if (!(warnings & 0x04)) {warnings |= 0x04; fprintf(stderr, "Warning: Pattern %d uses special panning effects not available in XM. It will not play correctly.\n", i);}
+                                if (!(warnings & 0x04)) {warnings |= 0x04; logMessage(stderr, "Warning: Pattern %d uses special panning effects not available in XM. It will not play correctly.\n", i);}
                             }
                         }
                         if (effect == 0x08) {effectop <<= 1; memory[channel].pan = effectop;}
@@ -831,84 +1885,69 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
             // Since Krawall doesn't need to fill all channels and XM does, convert that out
             for (int j = 0; j < mod->channels; j++) {
                 if (thisrow[j].xmflag) { // If this was set, the note should be added
-                    fputc(thisrow[j].xmflag, out);
-                    if (thisrow[j].xmflag & 0x01) fputc(thisrow[j].note, out);
+                    out.put(thisrow[j].xmflag);
+                    if (thisrow[j].xmflag & 0x01) out.put(thisrow[j].note);
                     if (thisrow[j].xmflag & 0x02) {
-                        if (thisrow[j].instrument == 0) fputc(0, out);
-                        else if (!trimInstruments) fputc(thisrow[j].instrument & 0x7F, out);
+                        if (thisrow[j].instrument == 0) out.put(0);
+                        else if (!trimInstruments) out.put(thisrow[j].instrument & 0x7F);
                         else {
                             // Convert the instrument number so we can reduce the number of instruments
-                            // Check if the instrument number is already in the list
-                            unsigned char myInstrument = 0;
-                            for (unsigned char k = 0; k < instrumentList.size(); k++) if (instrumentList[k] == thisrow[j].instrument - 1) {
-                                myInstrument = k + 1;
-                                break;
-                            }
+                            unsigned char& myInstrument = instrumentRemap[thisrow[j].instrument - 1];
                             // If the instrument wasn't already added to the list, then add it
                             if (myInstrument == 0) {
                                 // Instruments are listed as 8-bit numbers, so die if there are too many instruments
                                 if (instrumentList.size() >= 254) {
-                                    fprintf(stderr, "Error: Too many instruments in current pattern, cannot continue.\n");
+                                    logMessage(stderr, "Error: Too many instruments in current pattern, cannot continue.\n");
                                     free(thisrow);
                                     delete[] memory;
-                                    for (int l = 0; l < patternCount; l++) free((void*)mod->patterns[l]);
-                                    free(mod);
-                                    fclose(out);
+                                    closeOutputFile(fp);
                                     return 3;
                                 }
                                 instrumentList.push_back(thisrow[j].instrument - 1);
                                 myInstrument = instrumentList.size();
                             }
-                            fputc(myInstrument, out);
+                            out.put(myInstrument);
                         }
                     }
-                    if (thisrow[j].xmflag & 0x04) fputc(thisrow[j].volume, out);
+                    if (thisrow[j].xmflag & 0x04) out.put(thisrow[j].volume);
                     if (thisrow[j].xmflag & 0x08) {
                         if (fixCompatibility && thisrow[j].effect == 0x09 && (thisrow[j].xmflag & 0x10))
-                            sampleOffsetList[thisrow[j].instrument - 1].push_back(std::make_pair(thisrow[j].effectop, ftell(out)));
-                        fputc(thisrow[j].effect, out);
+                            sampleOffsetList[thisrow[j].instrument - 1].push_back(std::make_pair(thisrow[j].effectop, out.tell()));
+                        out.put(thisrow[j].effect);
                     }
-                    if (thisrow[j].xmflag & 0x10) fputc(thisrow[j].effectop, out);
-                } else fputc(0x80, out); // Empty note (do nothing this row)
+                    if (thisrow[j].xmflag & 0x10) out.put(thisrow[j].effectop);
+                } else out.put(0x80); // Empty note (do nothing this row)
             }
         }
         free(thisrow);
         delete[] memory;
         // Write the size of the packed pattern data
-        uint32_t endPos = ftell(out);
-        fseek(out, sizePos, SEEK_SET);
-        unsigned short size = endPos - sizePos - 2;
-        fwrite(&size, 2, 1, out);
-        fseek(out, endPos, SEEK_SET);
+        out.patch16(sizePos, out.tell() - sizePos - 2);
     }
     // Write the total number of instruments used in the module
     if (trimInstruments) {
-        uint32_t endPos = ftell(out);
-        fseek(out, instrumentSizePos, SEEK_SET);
-        pnum = instrumentList.size();
-        fwrite(&pnum, 2, 1, out);
-        fseek(out, endPos, SEEK_SET);
+        out.patch16(instrumentSizePos, instrumentList.size());
     } else if (mod->flagInstrumentBased) for (int i = 0; i < instrumentOffsets.size(); i++) instrumentList.push_back(i); // Add all instruments if not trimming & we're using instruments
     else for (int i = 0; i < sampleOffsets.size(); i++) instrumentList.push_back(i); // Add all samples if not trimming & not using instruments
     if (mod->flagInstrumentBased) {
         // Write all of the instruments used by the module
         for (unsigned short i : instrumentList) {
             // Read the instrument info
-            Instrument instr = readInstrumentFile(instfp, instrumentOffsets[i]);
+            Instrument instr = readInstrumentFile(instrom, instrumentOffsets[i]);
             // Find all of the unique samples
             std::vector<unsigned short> samples;
             samples.resize(96);
             samples.erase(std::unique_copy(instr.samples, instr.samples + 96, samples.begin()), samples.end());
             unsigned short snum = samples.size();
             // Start writing instrument header
-            fputc(snum == 0 ? 29 : 252, out);
-            fputcn(0, 3, out); // 4-byte padding
+            out.put(snum == 0 ? 29 : 252);
+            out.putn(0, 3); // 4-byte padding
             char name[22];
             memset(name, 0, 22);
             snprintf(name, 22, "Instrument%d", i);
-            fwrite(name, 1, 22, out);
-            fputc(0, out);
-            fwrite(&snum, 2, 1, out);
+            out.write(name, 22);
+            out.put(0);
+            out.u16(snum);
             if (snum == 0) continue; // XM spec says if there's no samples then skip the rest
             // Convert arbitrary sample numbers in the sample map to 0, 1, 2, etc.
             // This is because Krawall has a global sample map, while XM counts samples per instrument
@@ -917,41 +1956,41 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
             for (unsigned char i = 0; i < snum; i++) sample_conversion[samples[i]] = i;
             for (int i = 0; i < 96; i++) new_samples[i] = sample_conversion[instr.samples[i]];
             // Write instrument data
-            fputc(40, out);
-            fputcn(0, 3, out); // 4-byte padding
-            fwrite(new_samples, 1, 96, out);
+            out.put(40);
+            out.putn(0, 3); // 4-byte padding
+            out.write(new_samples, 96);
             // Convert envelopes to XM format
             // Turns out we don't even need the inc field! Everything's packed in coord.
             unsigned short tmp;
             for (int j = 0; j < 12; j++) {
                 tmp = instr.envVol.nodes[j].coord & 0x1ff;
-                fwrite(&tmp, 2, 1, out);
+                out.u16(tmp);
                 tmp = instr.envVol.nodes[j].coord >> 9;
-                fwrite(&tmp, 2, 1, out);
+                out.u16(tmp);
             }
             for (int j = 0; j < 12; j++) {
                 tmp = instr.envPan.nodes[j].coord & 0x1ff;
-                fwrite(&tmp, 2, 1, out);
+                out.u16(tmp);
                 tmp = instr.envPan.nodes[j].coord >> 9;
-                fwrite(&tmp, 2, 1, out);
+                out.u16(tmp);
             }
             // Here's a whole bunch of envelope parameters to write
-            fputc(instr.envVol.max + 1, out);
-            fputc(instr.envPan.max + 1, out);
-            fputc(instr.envVol.sus, out);
-            fputc(instr.envVol.loopStart, out);
-            fputc(instr.envVol.max, out);
-            fputc(instr.envPan.sus, out);
-            fputc(instr.envPan.loopStart, out);
-            fputc(instr.envPan.max, out);
-            fputc(instr.envVol.flags, out);
-            fputc(instr.envPan.flags, out);
-            fputc(instr.vibType, out);
-            fputc(instr.vibSweep, out);
-            fputc(instr.vibDepth, out);
-            fputc(instr.vibRate, out);
-            fwrite(&instr.volFade, 2, 1, out);
-            fputcn(0, 11, out); // Padding as required by XM
+            out.put(instr.envVol.max + 1);
+            out.put(instr.envPan.max + 1);
+            out.put(instr.envVol.sus);
+            out.put(instr.envVol.loopStart);
+            out.put(instr.envVol.max);
+            out.put(instr.envPan.sus);
+            out.put(instr.envPan.loopStart);
+            out.put(instr.envPan.max);
+            out.put(instr.envVol.flags);
+            out.put(instr.envPan.flags);
+            out.put(instr.vibType);
+            out.put(instr.vibSweep);
+            out.put(instr.vibDepth);
+            out.put(instr.vibRate);
+            out.u16(instr.volFade);
+            out.putn(0, 11); // Padding as required by XM
             // Write all of the samples required for this instrument
             // XM requires all of the headers to be written before the data, so we read
             // all of the samples in one loop and then write the data in another
@@ -960,8 +1999,8 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
             for (int j = 0; j < snum; j++) {
                 if (samples[j] > sampleOffsets.size()) {
                     // If the sample isn't present then insert an empty sample
-                    fprintf(stderr, "Warning: Could not find sample %d in instrument %d; inserting an empty sample to avoid breaking things.\n", samples[j], i);
-                    fputcn(0, 40, out);
+                    logMessage(stderr, "Warning: Could not find sample %d in instrument %d; inserting an empty sample to avoid breaking things.\n", samples[j], i);
+                    out.putn(0, 40);
                     // Add an empty sample structure to the sample list
                     Sample * blank = (Sample*)malloc(sizeof(Sample));
                     memset(blank, 0, sizeof(Sample));
@@ -969,37 +2008,31 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
                     continue;
                 }
                 // Read the sample from the file
-                Sample * s = readSampleFile(instfp, sampleOffsets[samples[j]]);
+                Sample * s = readSampleFile(instrom, sampleOffsets[samples[j]]);
                 // Write the sample header
-                fwrite(&s->size, 4, 1, out);
+                out.u32(s->size);
                 // Loop start has to be computed from the end & length
-                if (s->loopLength == 0) fputcn(0, 4, out);
+                if (s->loopLength == 0) out.putn(0, 4);
                 else {
                     uint32_t start = s->size - s->loopLength;
-                    fwrite(&start, 4, 1, out);
+                    out.u32(start);
                 }
                 // Some other sample parameters
-                fwrite(&s->loopLength, 4, 1, out);
-                fputc(s->volDefault, out);
-                fputc(s->fineTune, out);
-                fputc((s->loop ? 1 : 0), out);
-                fputc(s->panDefault + 0x80, out);
-                fputc(s->relativeNote, out);
-                fputc(0, out);
+                out.u32(s->loopLength);
+                out.put(s->volDefault);
+                out.put(s->fineTune);
+                out.put((s->loop ? 1 : 0));
+                out.put(s->panDefault + 0x80);
+                out.put(s->relativeNote);
+                out.put(0);
                 memset(name, ' ', 22);
                 snprintf(name, 22, "Sample%d", samples[j]);
-                fwrite(name, 1, 22, out);
+                out.write(name, 22);
                 sarr.push_back(s); // Push the read sample back so we don't have to allocate & read it again
                 // Update any offset effects that are too big for the instrument
                 if (fixCompatibility && sampleOffsetList.find(i) != sampleOffsetList.end()) {
-                    unsigned long retpos = ftell(out);
-                    for (std::pair<unsigned char, unsigned long> eff : sampleOffsetList[i]) {
-                        if (eff.first >= (s->size >> 8)) {
-                            fseek(out, eff.second, SEEK_SET);
-                            fputcn(0, 2, out);
-                        }
-                    }
-                    fseek(out, retpos, SEEK_SET);
+                    for (std::pair<unsigned char, unsigned long> eff : sampleOffsetList[i])
+                        if (eff.first >= (s->size >> 8)) out.fill(eff.second, 0, 2);
                 }
             }
             // Write the actual sample data
@@ -1007,11 +2040,7 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
                 Sample * s = sarr[j];
                 // Everything's written as deltas instead of absolute values
                 // We also convert from signed to unsigned here since it has to be unsigned
-                unsigned char old = 0;
-                for (uint32_t k = 0; k < s->size; k++) {
-                    fputc(((int)s->data[k] + 0x80) - old, out);
-                    old = (int)s->data[k] + 0x80;
-                }
+                deltaEncode(s->data, s->size, out.append(s->size));
                 free(s);
             }
         }
@@ -1019,94 +2048,108 @@ int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vect
         // Not using instruments, so one sample = one instrument
         for (unsigned short i : instrumentList) {
             // Basic Instrument header
-            fputc(252, out);
-            fputcn(0, 3, out); // 4-byte padding
+            out.put(252);
+            out.putn(0, 3); // 4-byte padding
             char name[22];
             memset(name, 0, 22);
             snprintf(name, 22, "Instrument%d", i);
-            fwrite(name, 1, 22, out);
-            fputc(0, out);
-            fputc(1, out); // 1 sample
-            fputc(0, out);
-            fputc(40, out);
-            fputcn(0, 3 + 96 + 96 + 16, out); // 4-byte padding + rest of instrument data (all 0)
-            fputcn(0, 11, out); // Padding as required by XM
-            Sample * s = readSampleFile(instfp, sampleOffsets[i]);
+            out.write(name, 22);
+            out.put(0);
+            out.put(1); // 1 sample
+            out.put(0);
+            out.put(40);
+            out.putn(0, 3 + 96 + 96 + 16); // 4-byte padding + rest of instrument data (all 0)
+            out.putn(0, 11); // Padding as required by XM
+            Sample * s = readSampleFile(instrom, sampleOffsets[i]);
             // Write the sample header
-            fwrite(&s->size, 4, 1, out);
+            out.u32(s->size);
             // Loop start has to be computed from the end & length
-            if (s->loopLength == 0) fputcn(0, 4, out);
+            if (s->loopLength == 0) out.putn(0, 4);
             else {
                 uint32_t start = s->size - s->loopLength;
-                fwrite(&start, 4, 1, out);
+                out.u32(start);
             }
             // Some other sample parameters
-            fwrite(&s->loopLength, 4, 1, out);
-            fputc(s->volDefault, out);
-            fputc(s->fineTune, out);
-            fputc((s->loop ? 1 : 0), out);
-            fputc(s->panDefault + 0x80, out);
-            fputc(s->relativeNote, out);
-            fputc(0, out);
+            out.u32(s->loopLength);
+            out.put(s->volDefault);
+            out.put(s->fineTune);
+            out.put((s->loop ? 1 : 0));
+            out.put(s->panDefault + 0x80);
+            out.put(s->relativeNote);
+            out.put(0);
             memset(name, ' ', 22);
             snprintf(name, 22, "Sample%d", i);
-            fwrite(name, 1, 22, out);
+            out.write(name, 22);
             // Update any offset effects that are too big for the instrument
             if (fixCompatibility && sampleOffsetList.find(i) != sampleOffsetList.end()) {
-                unsigned long retpos = ftell(out);
-                for (std::pair<unsigned char, unsigned long> eff : sampleOffsetList[i]) {
-                    if ((unsigned short)eff.first << 8 > s->size) {
-                        fseek(out, eff.second, SEEK_SET);
-                        fputcn(0, 2, out);
-                    }
-                }
-                fseek(out, retpos, SEEK_SET);
+                for (std::pair<unsigned char, unsigned long> eff : sampleOffsetList[i])
+                    if ((unsigned short)eff.first << 8 > s->size) out.fill(eff.second, 0, 2);
             }
             // Everything's written as deltas instead of absolute values
             // We also convert from signed to unsigned here since it has to be unsigned
-            unsigned char old = 0;
-            for (uint32_t k = 0; k < s->size; k++) {
-                fputc(((int)s->data[k] + 0x80) - old, out);
-                old = (int)s->data[k] + 0x80;
-            }
+            deltaEncode(s->data, s->size, out.append(s->size));
             free(s);
         }
     }
-    // Free & close the patterns, module, & file
-    for (int i = 0; i < patternCount; i++) free((void*)mod->patterns[i]);
-    free(mod);
-    fclose(out);
-    printf("Successfully wrote module to %s.\n", filename);
+    // Write & close the file
+    bool written = out.writeTo(fp);
+    if (closeOutputFile(fp) != 0) written = false;
+    if (!written) {
+        logMessage(stderr, "Error: Could not write to output file %s.\n", filename);
+        return 2;
+    }
+    logMessage(stdout, "Successfully wrote module to %s.\n", filename);
     return 0;
 }
 
-// Writes a module from a file pointer to a new S3M file.
+int unkrawerter_writeModuleToXM(const ConversionContext& ctx, FILE* fp, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, bool fixCompatibility = true, FILE* instfp = NULL) {
+    RomImage rom(fp);
+    if (instfp == NULL || instfp == fp) return writeModuleToXM(ctx, rom, moduleOffset, sampleOffsets, instrumentOffsets, filename, trimInstruments, name, fixCompatibility, rom);
+    RomImage instrom(instfp);
+    return writeModuleToXM(ctx, rom, moduleOffset, sampleOffsets, instrumentOffsets, filename, trimInstruments, name, fixCompatibility, instrom);
+}
+
+int unkrawerter_writeModuleToXM(FILE* fp, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, bool fixCompatibility = true, FILE* instfp = NULL) {
+    return unkrawerter_writeModuleToXM(defaultContext, fp, moduleOffset, sampleOffsets, instrumentOffsets, filename, trimInstruments, name, fixCompatibility, instfp);
+}
+
+int unkrawerter_writeModuleToXM(const ConversionContext& ctx, const uint8_t * data, size_t size, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, bool fixCompatibility = true, const uint8_t * instdata = NULL, size_t instsize = 0) {
+    RomImage rom(data, size);
+    if (instdata == NULL) return writeModuleToXM(ctx, rom, moduleOffset, sampleOffsets, instrumentOffsets, filename, trimInstruments, name, fixCompatibility, rom);
+    RomImage instrom(instdata, instsize);
+    return writeModuleToXM(ctx, rom, moduleOffset, sampleOffsets, instrumentOffsets, filename, trimInstruments, name, fixCompatibility, instrom);
+}
+
+int unkrawerter_writeModuleToXM(const uint8_t * data, size_t size, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, bool fixCompatibility = true, const uint8_t * instdata = NULL, size_t instsize = 0) {
+    return unkrawerter_writeModuleToXM(defaultContext, data, size, moduleOffset, sampleOffsets, instrumentOffsets, filename, trimInstruments, name, fixCompatibility, instdata, instsize);
+}
+
+// Writes a module from a ROM image to a new S3M file.
 // S3M file format from http://web.archive.org/web/20060831105434/http://pipin.tmd.ns.ac.yu/extra/fileformat/modules/s3m/s3m.txt
-int unkrawerter_writeModuleToS3M(FILE* fp, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, FILE* instfp = NULL) {
-    if (instfp == NULL) instfp = fp;
+// Samples are read from instrom, which is the same as rom unless a bank is used.
+static int writeModuleToS3M(const ConversionContext& ctx, const RomImage& rom, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const char * filename, bool trimInstruments, const char * name, const RomImage& instrom) {
     // Die if there are too many instruments for S3M & we're not trimming instruments
     if (sampleOffsets.size() > 255 && !trimInstruments) {
-        fprintf(stderr, "Error: This module cannot be ripped without trimming instruments.\n");
+        logMessage(stderr, "Error: This module cannot be ripped without trimming instruments.\n");
         return 10;
     }
     // Open the S3M file
-    FILE* out = fopen(filename, "wb");
-    if (out == NULL) {
-        fprintf(stderr, "Error: Could not open output file %s for writing.\n", filename);
+    FILE* fp = openOutputFile(filename);
+    if (fp == NULL) {
+        logMessage(stderr, "Error: Could not open output file %s for writing.\n", filename);
         return 2;
     }
     // Read the module from the ROM
-    Module * mod = readModuleFile(fp, moduleOffset);
+    ModuleData module = readModuleFile(ctx, rom, moduleOffset);
+    Module * mod = &module.header;
     // Count how many patterns there are
     unsigned char patternCount = 0;
     for (int i = 0; i < mod->numOrders; i++) if (mod->order[i] != 254) patternCount = std::max(patternCount, mod->order[i]);
     patternCount++;
     // Check for some basic requirements before going further
-    if (mod->flagInstrumentBased || mod->patterns[0]->rows != 64) {
-        fprintf(stderr, "Error: This module does not support S3M output.\n");
-        for (int i = 0; i < patternCount; i++) free((void*)mod->patterns[i]);
-        free(mod);
-        fclose(out);
+    if (mod->flagInstrumentBased || module.patterns[0].rows != 64) {
+        logMessage(stderr, "Error: This module does not support S3M output.\n");
+        closeOutputFile(fp);
         return 3;
     }
     // If we're trimming instruments, go through all of the patterns and see which instruments we need
@@ -1114,74 +2157,56 @@ int unkrawerter_writeModuleToS3M(FILE* fp, uint32_t moduleOffset, const std::vec
     if (trimInstruments) {
         unsigned char nextInstrument = 1;
         for (int i = 0; i < patternCount; i++) {
-            const unsigned char * data = mod->patterns[i]->data;
-            for (int row = 0; row < 64 && data < mod->patterns[i]->data + mod->patterns[i]->length; row++) {
-                for (;;) {
-                    // Read the channel/next byte types
-                    unsigned char follow = *data++;
-                    if (!follow) break; // If it's 0, the row's done
-                    if (follow & 0x20) { // Note & instrument follows
-                        unsigned char note = *data++;
-                        unsigned short instrument = *data++;
-                        if (version < 0x20040707) { // For versions before 2004-07-07, note is high 7 bits & instrument is low 9 bits
-                            instrument |= (note & 1) << 8;
-                            note >>= 1;
-                        } else if (note & 0x80) { // For versions starting with 2004-07-07, if the note > 128, the instrument field is 2 bytes long
-                            instrument |= *data++ << 8;
-                            note &= 0x7f;
-                        }
-                        if (instrument != 0 && instrumentMap.find(instrument) == instrumentMap.end()) {
-                            if (nextInstrument == 255) {
-                                fprintf(stderr, "Error: Too many instruments in module, cannot continue.\n");
-                                for (int l = 0; l < patternCount; l++) free((void*)mod->patterns[l]);
-                                free(mod);
-                                fclose(out);
-                                return 3;
-                            }
-                            instrumentMap[instrument] = nextInstrument++;
-                        }
+            const DecodedPattern& pat = module.patterns[i];
+            for (uint32_t c = 0; c < pat.rowStart[std::min((int)pat.rows, 64)]; c++) {
+                unsigned short instrument = pat.instrument[c];
+                if ((pat.follow[c] & 0x20) && instrument != 0 && instrumentMap.find(instrument) == instrumentMap.end()) {
+                    if (nextInstrument == 255) {
+                        logMessage(stderr, "Error: Too many instruments in module, cannot continue.\n");
+                        closeOutputFile(fp);
+                        return 3;
                     }
-                    if (follow & 0x40) data++;
-                    if (follow & 0x80) data += 2;
+                    instrumentMap[instrument] = nextInstrument++;
                 }
             }
         }
     }
     // Write the S3M header info
-    if (name == NULL) fwrite("Krawall conversion\0\0\0\0\0\0\0\0\0\0", 28, 1, out);
+    ByteWriter out;
+    if (name == NULL) out.write("Krawall conversion\0\0\0\0\0\0\0\0\0\0", 28);
     else {
-        fwrite(name, 1, std::min(strlen(name), (size_t)28), out);
-        if (strlen(name) < 28) fputcn(0, 28 - strlen(name), out);
-    }
-    fputc(0x1A, out);
-    fputc(16, out); // Type (16=ST3 module)
-    fputcn(0, 2, out); // padding
-    fputc(mod->numOrders, out);
-    fputc(0, out);
-    fputc(trimInstruments ? instrumentMap.size() : sampleOffsets.size(), out);
-    fputc(0, out);
-    fputc(patternCount, out);
-    fputc(0, out);
-    fputc((mod->flagAmigaLimits ? 16 : 0) | (mod->flagVolOpt ? 8 : 0) | (mod->flagVolSlides ? 64 : 0), out);
-    fputc(0, out);
-    fputc(0x20, out); // Tracker version
-    fputc(0x13, out); // ^^
-    fputc(2, out); // Unsigned samples
-    fputc(0, out);
-    fwrite("SCRM", 4, 1, out);
-    fputc(mod->volGlobal, out);
-    fputc(mod->initSpeed, out);
-    fputc(mod->initBPM, out);
-    fputc(64, out); // Master volume (maximum)
-    fputc(0, out); // Ultra click removal
-    fputc(252, out); // Has channel pan positions
-    fputcn(0, 10, out); // padding
+        out.write(name, std::min(strlen(name), (size_t)28));
+        if (strlen(name) < 28) out.putn(0, 28 - strlen(name));
+    }
+    out.put(0x1A);
+    out.put(16); // Type (16=ST3 module)
+    out.putn(0, 2); // padding
+    out.put(mod->numOrders);
+    out.put(0);
+    out.put(trimInstruments ? instrumentMap.size() : sampleOffsets.size());
+    out.put(0);
+    out.put(patternCount);
+    out.put(0);
+    out.put((mod->flagAmigaLimits ? 16 : 0) | (mod->flagVolOpt ? 8 : 0) | (mod->flagVolSlides ? 64 : 0));
+    out.put(0);
+    out.put(0x20); // Tracker version
+    out.put(0x13); // ^^
+    out.put(2); // Unsigned samples
+    out.put(0);
+    out.write("SCRM", 4);
+    out.put(mod->volGlobal);
+    out.put(mod->initSpeed);
+    out.put(mod->initBPM);
+    out.put(64); // Master volume (maximum)
+    out.put(0); // Ultra click removal
+    out.put(252); // Has channel pan positions
+    out.putn(0, 10); // padding
     // Write the channel settings
-    for (int i = 0; i < mod->channels / 2; i++) fputc(i, out);
-    for (int i = 0; i < mod->channels / 2 + mod->channels % 2; i++) fputc(i | 8, out);
-    fputcn(0xFF, 32 - mod->channels, out);
+    for (int i = 0; i < mod->channels / 2; i++) out.put(i);
+    for (int i = 0; i < mod->channels / 2 + mod->channels % 2; i++) out.put(i | 8);
+    out.putn(0xFF, 32 - mod->channels);
     // Write all of the orders
-    fwrite(mod->order, 1, mod->numOrders, out);
+    out.write(mod->order, mod->numOrders);
     // Write parapointers
     int paddingBytes = 0;
     uint16_t tmp;
@@ -1190,31 +2215,29 @@ int unkrawerter_writeModuleToS3M(FILE* fp, uint32_t moduleOffset, const std::vec
         tmp = (0x60 + mod->numOrders + (trimInstruments ? instrumentMap.size() : sampleOffsets.size()) * 2 + patternCount * 2 + 32 + i * 0x50) + paddingBytes; // Header + orders + instrument parapointers + pattern parapointers + pan positions + previous instruments
         if (tmp & 0xF) {paddingBytes += 16 - (tmp & 0xF); tmp = (tmp & 0xFFF0) + 0x10;}
         tmp >>= 4;
-        fwrite(&tmp, 2, 1, out);
+        out.u16(tmp);
     }
     int offset = 0;
     // Write the parapointers to each pattern
     for (int i = 0; i < patternCount; i++) {
         // S3M requires all patterns to be exactly 64 rows, so die if any pattern has <> 64 rows
-        if (mod->patterns[i]->rows != 64) {
-            fprintf(stderr, "Error: This module does not support S3M output. (If S3M was auto-detected, try using the -x switch.)\n");
-            for (int i = 0; i < patternCount; i++) free((void*)mod->patterns[i]);
-            free(mod);
-            fclose(out);
+        if (module.patterns[i].rows != 64) {
+            logMessage(stderr, "Error: This module does not support S3M output. (If S3M was auto-detected, try using the -x switch.)\n");
+            closeOutputFile(fp);
             return 3;
         }
         tmp = 0x60 + mod->numOrders + (trimInstruments ? instrumentMap.size() : sampleOffsets.size()) * 0x52 + patternCount * 2 + 32 + offset + paddingBytes; // Header + orders + instrument parapointers + pattern parapointers + pan positions + instruments + previous patterns
         if (tmp & 0xF) {paddingBytes += 16 - (tmp & 0xF); tmp = (tmp & 0xFFF0) + 0x10;}
         tmp >>= 4;
-        fwrite(&tmp, 2, 1, out);
-        offset += mod->patterns[i]->s3mlength + 2;
+        out.u16(tmp);
+        offset += module.patterns[i].s3mlength + 2;
     }
     // Write channel pan positions
     for (int i = 0; i < mod->channels; i++) {
-        if (mod->channelPan[i] == 0) fputc(0x27, out);
-        else fputc((((int)mod->channelPan[i] + 128) >> 4) | 0x20, out);
+        if (mod->channelPan[i] == 0) out.put(0x27);
+        else out.put((((int)mod->channelPan[i] + 128) >> 4) | 0x20);
     }
-    fputcn(0x08, 32 - mod->channels, out);
+    out.putn(0x08, 32 - mod->channels);
     // Write each instrument header
     std::vector<Sample*> samples;
     for (int i = 0; i < (trimInstruments ? instrumentMap.size() : sampleOffsets.size()); i++) {
@@ -1229,32 +2252,32 @@ int unkrawerter_writeModuleToS3M(FILE* fp, uint32_t moduleOffset, const std::vec
             }
         } else inst = i;
         // Pad to 16 bytes
-        while (ftell(out) & 0xF) fputc(0, out);
-        fputc(1, out); // Type (1=Sample)
-        fputcn(0, 12, out); // DOS filename
+        while (out.tell() & 0xF) out.put(0);
+        out.put(1); // Type (1=Sample)
+        out.putn(0, 12); // DOS filename
         uint32_t memseg = 0x60 + mod->numOrders + (trimInstruments ? instrumentMap.size() : sampleOffsets.size()) * 0x52 + patternCount * 2 + 32 + offset + paddingBytes; // Header + orders + instrument parapointers + pattern parapointers + pan positions + instruments + patterns + previous samples
         if (memseg & 0xF) {paddingBytes += 16 - (memseg & 0xF); memseg = (memseg & 0xFFFFF0) + 0x10;}
         memseg >>= 4;
-        fputc((memseg >> 16) & 0xFF, out); // Sample parapointer high byte
-        fputc(memseg & 0xFF, out); // Sample parapointer low two bytes (LE)
-        fputc((memseg >> 8) & 0xFF, out);
-        Sample * s = readSampleFile(instfp, sampleOffsets[inst]);
-        fwrite(&s->size, 4, 1, out);
+        out.put((memseg >> 16) & 0xFF); // Sample parapointer high byte
+        out.put(memseg & 0xFF); // Sample parapointer low two bytes (LE)
+        out.put((memseg >> 8) & 0xFF);
+        Sample * s = readSampleFile(instrom, sampleOffsets[inst]);
+        out.u32(s->size);
         memseg = s->size - s->loopLength;
-        fwrite(&memseg, 4, 1, out); // Loop beginning
+        out.u32(memseg); // Loop beginning
         memseg = s->size + 1;
-        fwrite(&memseg, 4, 1, out); // Loop end
-        fputc(s->volDefault, out);
-        fputcn(0, 2, out); // Padding, packing type (0)
-        fputc((s->loop ? 1 : 0), out); // Flags
-        fwrite(&s->c2Freq, 4, 1, out);
-        fputcn(0, 12, out); // Padding/unused
+        out.u32(memseg); // Loop end
+        out.put(s->volDefault);
+        out.putn(0, 2); // Padding, packing type (0)
+        out.put((s->loop ? 1 : 0)); // Flags
+        out.u32(s->c2Freq);
+        out.putn(0, 12); // Padding/unused
         // Write sample name
         char name[28];
         memset(name, 0, 28);
         snprintf(name, 28, "Sample%d", inst);
-        fwrite(name, 1, 28, out);
-        fwrite("SCRS", 4, 1, out);
+        out.write(name, 28);
+        out.write("SCRS", 4);
         offset += s->size;
         samples.push_back(s);
     }
@@ -1262,60 +2285,51 @@ int unkrawerter_writeModuleToS3M(FILE* fp, uint32_t moduleOffset, const std::vec
     // Krawall pattern data is nearly identical to S3M packed pattern data, so not much conversion is needed
     // We only really need to fix the note/instrument packing, volume column format, and effects
     for (int i = 0; i < patternCount; i++) {
+        const DecodedPattern& pat = module.patterns[i];
         // Pad to 16 bytes
-        while (ftell(out) & 0xF) fputc(0, out);
+        while (out.tell() & 0xF) out.put(0);
         // Write the pattern length (it'll be the same length as the Krawall data)
-        fwrite(&mod->patterns[i]->s3mlength, 2, 1, out);
-        const unsigned char * data = mod->patterns[i]->data;
+        out.u16(pat.s3mlength);
         int warnings = 0;
         unsigned char globalFix[32];
         unsigned char globalMemory[32][15]; // Some effects use global memory that Krawall doesn't emulate, so we fix that
         memset(globalFix, 0, 32);
         for (int j = 0; j < mod->channels; j++) memset(globalMemory[j], 0, 15);
         // Loop through each row of the pattern
-        for (int row = 0; row < 64 && data < mod->patterns[i]->data + mod->patterns[i]->length; row++) {
-            for (;;) {
-                // Read the channel/next byte types
-                unsigned char follow = *data++;
-                fputc(follow, out);
-                if (!follow) break; // If it's 0, the row's done
+        for (int row = 0; row < std::min((int)pat.rows, 64); row++) {
+            for (uint32_t c = pat.rowStart[row]; c < pat.rowStart[row + 1]; c++) {
+                unsigned char follow = pat.follow[c];
+                out.put(follow);
                 if (follow & 0x20) { // Note & instrument follows
-                    unsigned char note = *data++;
-                    unsigned short instrument = *data++;
-                    if (version < 0x20040707) { // For versions before 2004-07-07, note is high 7 bits & instrument is low 9 bits
-                        instrument |= (note & 1) << 8;
-                        note >>= 1;
-                    } else if (note & 0x80) { // For versions starting with 2004-07-07, if the note > 128, the instrument field is 2 bytes long
-                        instrument |= *data++ << 8;
-                        note &= 0x7f;
-                    }
-                    if (note >= 97 || note == 0) fputc(254, out); // 254 = note off
-                    else fputc((((note - 1) / 12) << 4) | ((note - 1) % 12), out); // S3M wants hi=oct, lo=note
-                    fputc(trimInstruments ? (instrument == 0 ? 0 : instrumentMap[instrument]) : instrument, out); // Write instrument
+                    unsigned char note = pat.note[c];
+                    unsigned short instrument = pat.instrument[c];
+                    if (note >= 97 || note == 0) out.put(254); // 254 = note off
+                    else out.put((((note - 1) / 12) << 4) | ((note - 1) % 12)); // S3M wants hi=oct, lo=note
+                    out.put(trimInstruments ? (instrument == 0 ? 0 : instrumentMap[instrument]) : instrument); // Write instrument
                 }
                 if (follow & 0x40) { // Volume follows
                     // XM/Krawall stores volume from 0x10-0x50, while S3M expects it at 0x00-0x40, so subtract to fix
-                    unsigned char volume = *data++;
-                    if (volume < 0x10) fputc(0xFF, out); // < 0x10 = nothing
-                    else if (volume <= 0x50) fputc(volume - 0x10, out); // 0x10 - 0x50 = volume
+                    unsigned char volume = pat.volume[c];
+                    if (volume < 0x10) out.put(0xFF); // < 0x10 = nothing
+                    else if (volume <= 0x50) out.put(volume - 0x10); // 0x10 - 0x50 = volume
                     else if (volume >= 0xC0 && volume < 0xD0) {
-                        if (!(warnings & 0x02)) {warnings |= 0x02; fprintf(stderr, "Warning: Pattern %d uses special volume column effects only available in OpenMPT. It may not play correctly in other trackers.\n", i);}
-                        fputc(((volume - 0xC0) << 2) | 0x80, out); // 0xC0 - 0xCF = panning (MPT only)
+                        if (!(warnings & 0x02)) {warnings |= 0x02; logMessage(stderr, "Warning: Pattern %d uses special volume column effects only available in OpenMPT. It may not play correctly in other trackers.\n", i);}
+                        out.put(((volume - 0xC0) << 2) | 0x80); // 0xC0 - 0xCF = panning (MPT only)
                     } else {
-                        if (!(warnings & 0x01)) {warnings |= 0x01; fprintf(stderr, "Warning: Pattern %d uses special volume column effects not available in S3M. It will not play correctly.\n", i);}
-                        fputc(0xFF, out);
+                        if (!(warnings & 0x01)) {warnings |= 0x01; logMessage(stderr, "Warning: Pattern %d uses special volume column effects not available in S3M. It will not play correctly.\n", i);}
+                        out.put(0xFF);
                     }
                 }
                 if (follow & 0x80) { // Effect follows
-                    unsigned char effect = *data++;
-                    unsigned char effectop = *data++;
+                    unsigned char effect = pat.effect[c];
+                    unsigned char effectop = pat.effectop[c];
                     if (effect == 3) { // Speed/BPM
                         if (effectop >= 0x20) effect = 0x1D;
                         else effect = 0x0A;
                     } else { // Other effects
                         // Convert the Krawall effect into an S3M effect
-                        unsigned short s3meffect = effectMap_s3m[effect].first;
-                        unsigned char effectmask = effectMap_s3m[effect].second;
+                        unsigned short s3meffect = effectMap_s3m[effect < EFFECT_COUNT ? effect : 0].first;
+                        unsigned char effectmask = effectMap_s3m[effect < EFFECT_COUNT ? effect : 0].second;
                         if (effect == 9) effectop <<= 4; // Volume slide up needs to shift the op up by 4 bits
                         s3meffect = s3meffect | (effectop & effectmask);
                         effect = s3meffect >> 8;
@@ -1328,34 +2342,60 @@ int unkrawerter_writeModuleToS3M(FILE* fp, uint32_t moduleOffset, const std::vec
                         globalFix[follow & 31] = effect;
                     }
                     // Write the final effect
-                    fputc(effect, out);
-                    fputc(effectop, out);
+                    out.put(effect);
+                    out.put(effectop);
                 }
             }
+            out.put(0); // End of row
         }
     }
     // Write sample data
     for (int i = 0; i < samples.size(); i++) {
-        while (ftell(out) & 0xF) fputc(0, out);
+        while (out.tell() & 0xF) out.put(0);
         Sample * s = samples[i];
-        fwrite(s->data, 1, s->size, out);
+        out.write(s->data, s->size);
         free(s);
     }
-    // Free & close the patterns, module, & file
-    for (int i = 0; i < patternCount; i++) free((void*)mod->patterns[i]);
-    free(mod);
-    fclose(out);
-    printf("Successfully wrote module to %s.\n", filename);
+    // Write & close the file
+    bool written = out.writeTo(fp);
+    if (closeOutputFile(fp) != 0) written = false;
+    if (!written) {
+        logMessage(stderr, "Error: Could not write to output file %s.\n", filename);
+        return 2;
+    }
+    logMessage(stdout, "Successfully wrote module to %s.\n", filename);
     return 0;
 }
 
-bool unkrawerter_writeBankFile(FILE* fp, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename) {
+int unkrawerter_writeModuleToS3M(const ConversionContext& ctx, FILE* fp, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, FILE* instfp = NULL) {
+    RomImage rom(fp);
+    if (instfp == NULL || instfp == fp) return writeModuleToS3M(ctx, rom, moduleOffset, sampleOffsets, filename, trimInstruments, name, rom);
+    RomImage instrom(instfp);
+    return writeModuleToS3M(ctx, rom, moduleOffset, sampleOffsets, filename, trimInstruments, name, instrom);
+}
+
+int unkrawerter_writeModuleToS3M(FILE* fp, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, FILE* instfp = NULL) {
+    return unkrawerter_writeModuleToS3M(defaultContext, fp, moduleOffset, sampleOffsets, filename, trimInstruments, name, instfp);
+}
+
+int unkrawerter_writeModuleToS3M(const ConversionContext& ctx, const uint8_t * data, size_t size, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, const uint8_t * instdata = NULL, size_t instsize = 0) {
+    RomImage rom(data, size);
+    if (instdata == NULL) return writeModuleToS3M(ctx, rom, moduleOffset, sampleOffsets, filename, trimInstruments, name, rom);
+    RomImage instrom(instdata, instsize);
+    return writeModuleToS3M(ctx, rom, moduleOffset, sampleOffsets, filename, trimInstruments, name, instrom);
+}
+
+int unkrawerter_writeModuleToS3M(const uint8_t * data, size_t size, uint32_t moduleOffset, const std::vector<uint32_t> &sampleOffsets, const char * filename, bool trimInstruments = true, const char * name = NULL, const uint8_t * instdata = NULL, size_t instsize = 0) {
+    return unkrawerter_writeModuleToS3M(defaultContext, data, size, moduleOffset, sampleOffsets, filename, trimInstruments, name, instdata, instsize);
+}
+
+static bool writeBankFile(const ConversionContext& ctx, const RomImage& rom, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename) {
     FILE* out = fopen(filename, "wb");
     if (out == NULL) {
-        fprintf(stderr, "Error: Could not open output file %s for writing.\n", filename);
+        logMessage(stderr, "Error: Could not open output file %s for writing.\n", filename);
         return false;
     }
-    fwrite(version < 0x20040707 ? "KRWC" : "KRWB", 4, 1, out);
+    fwrite(ctx.version < 0x20040707 ? "KRWC" : "KRWB", 4, 1, out);
     uint16_t tmp = instrumentOffsets.size();
     fwrite(&tmp, 2, 1, out);
     tmp = sampleOffsets.size();
@@ -1367,8 +2407,7 @@ bool unkrawerter_writeBankFile(FILE* fp, const std::vector<uint32_t> &sampleOffs
     fputcn(0, sampleOffsets.size() * 4, out);
     for (int i = 0; i < instrumentOffsets.size(); i++) {
         uint8_t data[sizeof(Instrument)];
-        fseek(fp, instrumentOffsets[i], SEEK_SET);
-        fread(data, sizeof(Instrument), 1, fp);
+        rom.copy(data, instrumentOffsets[i], sizeof(Instrument));
         fwrite(data, sizeof(Instrument), 1, out);
     }
     for (int i = 0; i < sampleOffsets.size(); i++) {
@@ -1377,100 +2416,450 @@ bool unkrawerter_writeBankFile(FILE* fp, const std::vector<uint32_t> &sampleOffs
         fseek(out, (instrumentOffsets.size() + i) * 4 + 8, SEEK_SET);
         fwrite(&off, 4, 1, out);
         fseek(out, off, SEEK_SET);
-        fseek(fp, sampleOffsets[i], SEEK_SET);
-        fread(&data, sizeof(Sample) - 1, 1, fp);
+        rom.copy(&data, sampleOffsets[i], sizeof(Sample) - 1);
         data.size = (data.size & 0x1ffffff) - sampleOffsets[i] + off + 18;
         fwrite(&data, sizeof(Sample) - 1, 1, out);
-        void * samples = malloc(data.size - off - 18);
-        fread(samples, 1, data.size - off - 18, fp);
-        fwrite(samples, 1, data.size - off - 18, out);
-        free(samples);
+        uint32_t length = data.size - off - 18;
+        const uint8_t * samples = rom.view(sampleOffsets[i] + sizeof(Sample) - 1, length);
+        if (samples != NULL) fwrite(samples, 1, length, out);
+        else {
+            std::vector<uint8_t> padded(length);
+            rom.copy(&padded[0], sampleOffsets[i] + sizeof(Sample) - 1, length);
+            fwrite(&padded[0], 1, length, out);
+        }
     }
-    printf("Successfully wrote instrument bank to %s.\n", filename);
+    logMessage(stdout, "Successfully wrote instrument bank to %s.\n", filename);
     fclose(out);
     return true;
 }
 
-bool unkrawerter_writeModuleFile(FILE* fp, uint32_t moduleOffset, const char * filename) {
+bool unkrawerter_writeBankFile(const ConversionContext& ctx, FILE* fp, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename) {
+    RomImage rom(fp);
+    return writeBankFile(ctx, rom, sampleOffsets, instrumentOffsets, filename);
+}
+
+bool unkrawerter_writeBankFile(FILE* fp, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename) {
+    return unkrawerter_writeBankFile(defaultContext, fp, sampleOffsets, instrumentOffsets, filename);
+}
+
+bool unkrawerter_writeBankFile(const ConversionContext& ctx, const uint8_t * data, size_t size, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename) {
+    RomImage rom(data, size);
+    return writeBankFile(ctx, rom, sampleOffsets, instrumentOffsets, filename);
+}
+
+bool unkrawerter_writeBankFile(const uint8_t * data, size_t size, const std::vector<uint32_t> &sampleOffsets, const std::vector<uint32_t> &instrumentOffsets, const char * filename) {
+    return unkrawerter_writeBankFile(defaultContext, data, size, sampleOffsets, instrumentOffsets, filename);
+}
+
+static bool writeModuleFile(const ConversionContext& ctx, const RomImage& rom, uint32_t moduleOffset, const char * filename) {
     FILE* out = fopen(filename, "wb");
     if (out == NULL) {
-        fprintf(stderr, "Error: Could not open output file %s for writing.\n", filename);
+        logMessage(stderr, "Error: Could not open output file %s for writing.\n", filename);
         return false;
     }
-    fwrite("KRWM", 4, 1, out);
+    ByteWriter data;
+    data.write("KRWM", 4);
     Module mod;
-    fseek(fp, moduleOffset, SEEK_SET);
-    fread(&mod, sizeof(Module)-sizeof(Pattern*), 1, fp);
-    fwrite(&mod, sizeof(Module)-sizeof(Pattern*), 1, out);
+    rom.copy(&mod, moduleOffset, sizeof(Module)-sizeof(Pattern*));
+    data.write(&mod, sizeof(Module)-sizeof(Pattern*));
     unsigned char patternCount = 0;
     for (int i = 0; i < mod.numOrders; i++) if (mod.order[i] < 254) patternCount = std::max(patternCount, mod.order[i]);
     patternCount++;
-    fputcn(0, patternCount * 4, out);
-    std::vector<uint32_t> patternOffsets;
+    data.putn(0, patternCount * 4);
     for (int i = 0; i < patternCount; i++) {
-        uint32_t off = ftell(out);
-        fseek(out, sizeof(Module)-sizeof(Pattern*) + i*4 + 4, SEEK_SET);
-        fwrite(&off, 4, 1, out);
-        fseek(out, off, SEEK_SET);
-        uint32_t addr = 0;
-        fread(&addr, 4, 1, fp);
-        off = ftell(fp);
-        Pattern * pat = readPatternFile(fp, addr & 0x1ffffff, version < 0x20040707, false);
-        fseek(fp, off, SEEK_SET);
-        fwrite(pat->index, 2, 16, out);
-        fwrite(&pat->rows, 2, 1, out);
-        fwrite(pat->data, 1, pat->length, out);
-        free(pat);
-    }
-    printf("Successfully wrote ripped module to %s.\n", filename);
-    fclose(out);
+        data.patch32(sizeof(Module)-sizeof(Pattern*) + i*4 + 4, data.tell());
+        uint32_t addr = rom.u32(moduleOffset + sizeof(Module)-sizeof(Pattern*) + i*4) & 0x1ffffff;
+        // The pattern data is copied straight from the ROM image
+        PatternView view = scanPattern(rom, addr, ctx.version < 0x20040707, false);
+        rom.copy(data.append(32), addr, 32);
+        data.u16(view.rows);
+        if (view.available) data.write(view.data, view.available);
+        data.putn(0, view.length - view.available);
+    }
+    bool written = data.writeTo(out);
+    if (fclose(out) != 0 || !written) {
+        logMessage(stderr, "Error: Could not write to output file %s.\n", filename);
+        return false;
+    }
+    logMessage(stdout, "Successfully wrote ripped module to %s.\n", filename);
     return true;
 }
 
+bool unkrawerter_writeModuleFile(const ConversionContext& ctx, FILE* fp, uint32_t moduleOffset, const char * filename) {
+    RomImage rom(fp);
+    return writeModuleFile(ctx, rom, moduleOffset, filename);
+}
+
+bool unkrawerter_writeModuleFile(FILE* fp, uint32_t moduleOffset, const char * filename) {
+    return unkrawerter_writeModuleFile(defaultContext, fp, moduleOffset, filename);
+}
+
+bool unkrawerter_writeModuleFile(const ConversionContext& ctx, const uint8_t * data, size_t size, uint32_t moduleOffset, const char * filename) {
+    RomImage rom(data, size);
+    return writeModuleFile(ctx, rom, moduleOffset, filename);
+}
+
+bool unkrawerter_writeModuleFile(const uint8_t * data, size_t size, uint32_t moduleOffset, const char * filename) {
+    return unkrawerter_writeModuleFile(defaultContext, data, size, moduleOffset, filename);
+}
+
 #ifndef AS_LIBRARY
 
-// Looks for a string in a file
-static bool fstr(FILE* fp, const char * str) {
-    rewind(fp);
-    const char * ptr = str;
-    while (!feof(fp)) {
-        if (!*ptr) return true;
-        else if (fgetc(fp) == *ptr) ptr++;
-        else ptr = str;
+// Counts the number of pointers in a list, stopping at the first value that isn't an 0x08xxxxxx/0x09xxxxxx address
+static uint32_t countPointers(const RomImage& rom, uint32_t addr) {
+    uint32_t count = 0;
+    for (uint32_t tmp = rom.u32(addr); (tmp & 0xf6000000) == 0 && (tmp & 0x8000000) == 0x8000000; count++) tmp = rom.u32(addr + (count + 1) * 4);
+    return count;
+}
+
+// Computes a fast 64-bit hash of a ROM's contents, used to key the scan cache
+// This uses four independent lanes over 32-byte blocks (like xxHash64) so it runs near memory speed.
+static uint64_t hashRom(const RomImage& rom) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL, prime2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+    const uint8_t * data = rom.data();
+    size_t size = rom.size(), pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t w;
+            memcpy(&w, data + pos + i*8, 8);
+            lanes[i] += w * prime2;
+            lanes[i] = ((lanes[i] << 31) | (lanes[i] >> 33)) * prime1;
+        }
     }
-    return false;
+    uint64_t h = size * prime1;
+    for (int i = 0; i < 4; i++) h = ((h ^ lanes[i]) * prime1) + prime2;
+    for (; pos < size; pos++) h = ((h ^ data[pos]) * prime2) ^ (h >> 31);
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    return h;
 }
 
-int main(int argc, const char * argv[]) {
-    if (argc < 2 || strcmp(argv[1], "-h") == 0) {
-        // Help
-        fprintf(stderr, "Usage: %s [options...] <rom.gba>\n"
-                        "Options:\n"
-                        "  -f <file.krm>     Ripped module to convert; may be used multiple times\n"
-                        "                      If this option is specified, the <rom.gba> argument must point to the bank instead\n"
-                        "  -i <address>      Override instrument list address\n"
-                        "  -l <file.txt>     Read module names from a file (one name/line, same format as -n)\n"
-                        "  -m <address>      Add an extra module address to the list\n"
-                        "  -n <addr>=<name>  Assign a name to a module address (max. 20 characters for XM, 28 for S3M)\n"
-                        "  -o <directory>    Output directory\n"
-                        "  -s <address>      Override sample list address\n"
-                        "  -t <threshold>    Search threshold, lower = slower but finds smaller modules,\n"
-                        "                      higher = faster but misses smaller modules (defaults to 4)\n"
-                        "  -3                Force extraction to output S3M modules (only supported with some modules)\n"
-                        "  -a                Do not trim extra instruments; this will make modules much larger in size!\n"
-                        "  -c                Disable compatibility fixes, makes patterns more accurate but worsens playback\n"
-                        "  -e                Export samples to WAV files\n"
-                        "  -k                Force Krawall version to 20030901 (disables auto-detection)\n"
-                        "  -K                Force Krawall version to 20050421 (disables auto-detection)\n"
-                        "  -r                Rip data into Krawall bank/modules without conversion\n"
-                        "  -v                Enable verbose mode\n"
-                        "  -x                Force extraction to output XM modules\n"
-                        "  -h                Show this help\n", argv[0]);
-        return 1;
+/*
+    Scan cache (.krs) file format, stored as <hash>-<threshold>-<version>.krs:
+    * 4 bytes: Magic number "KRWS"
+    * 4 bytes: Format version (SCAN_CACHE_VERSION); files with any other version are ignored
+    * 8 bytes: ROM hash
+    * 4 bytes: ROM size
+    * 4 bytes: Search threshold
+    * 4 bytes: Forced Krawall version, or 0 if auto-detected
+    * 4 bytes: Detected Krawall version
+    * 4 bytes: Krawall version from signature, or 0 if none
+    * 4 bytes: Whether the Krawall signature was found
+    * 4*4 bytes: Instrument list address & count, sample list address & count
+    * 4 bytes: Number of modules
+    * 4*[x] bytes: Module addresses
+    * 4 bytes: Number of candidates
+    * 16*[y] bytes: Candidates (address, count, type, confidence)
+*/
+
+// Version of the scan cache format & the search results stored in it; this must be increased whenever
+// the file format changes, or the search finds or rates lists differently, so old results aren't reused
+#define SCAN_CACHE_VERSION 2
+
+/*
+    Game database file format (text):
+    * Lines starting with '#' or ';' are comments
+    * [CODE-RR] starts an entry for the game with the 4-character game code CODE and
+      revision RR (2 hex digits) in the cartridge header, e.g. [AXVE-00]
+    * [0123456789abcdef] starts an entry for the ROM with the specified hash (as used for -d)
+    * version=YYYYMMDD sets the Krawall version
+    * instruments=<address> and samples=<address> set the instrument & sample list addresses
+    * module=<address> adds a module address
+    * <address>=<name> adds a module address with a name (same format as -l)
+    All addresses are in hex.
+*/
+
+// Known offsets & names for a game, loaded from a game database
+struct GameEntry {
+    uint32_t version = 0;
+    uint32_t instrumentAddr = 0;
+    uint32_t sampleAddr = 0;
+    std::vector<uint32_t> modules;
+    std::map<uint32_t, std::string> names;
+};
+
+// Loads a game database file into a map keyed by "CODE-RR" or the ROM hash in hex
+// Returns false if the file couldn't be opened or has a malformed line.
+static bool loadGameDatabase(const char * path, std::map<std::string, GameEntry>& db) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) return false;
+    GameEntry * entry = NULL;
+    std::string line;
+    bool ok = true;
+    while (ok && !feof(fp)) {
+        line.clear();
+        for (int c = fgetc(fp); c != '\n' && c != EOF; c = fgetc(fp)) if (c >= 0x20) line += (char)c;
+        if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+        if (line[0] == '[') {
+            size_t end = line.find(']');
+            if (end == std::string::npos) {ok = false; break;}
+            entry = &db[line.substr(1, end - 1)];
+            continue;
+        }
+        size_t pos = line.find('=');
+        if (entry == NULL || pos == std::string::npos || pos == 0 || pos + 1 == line.size()) {ok = false; break;}
+        std::string key = line.substr(0, pos), value = line.substr(pos + 1);
+        try {
+            if (key == "version") entry->version = std::stoul(value, nullptr, 16);
+            else if (key == "instruments") entry->instrumentAddr = std::stoul(value, nullptr, 16) & 0x1ffffff;
+            else if (key == "samples") entry->sampleAddr = std::stoul(value, nullptr, 16) & 0x1ffffff;
+            else if (key == "module") entry->modules.push_back(std::stoul(value, nullptr, 16) & 0x1ffffff);
+            else {
+                uint32_t addr = std::stoul(key, nullptr, 16) & 0x1ffffff;
+                if (value.size() > 20) value.erase(20);
+                entry->modules.push_back(addr);
+                entry->names[addr] = value;
+            }
+        } catch (std::exception &e) {
+            ok = false;
+        }
     }
-    // Command-line argument parsing
+    fclose(fp);
+    return ok;
+}
+
+// Looks up a ROM in a game database, first by header game code & revision, then by hash
+static const GameEntry * findGame(const std::map<std::string, GameEntry>& db, const RomImage& rom, uint64_t hash) {
+    char key[17];
+    rom.copy(key, 0xAC, 4);
+    snprintf(key + 4, 13, "-%02X", rom.u8(0xBC));
+    std::map<std::string, GameEntry>::const_iterator it = db.find(key);
+    if (it != db.end() && key[0]) return &it->second;
+    snprintf(key, 17, "%016llx", (unsigned long long)hash);
+    it = db.find(key);
+    return it != db.end() ? &it->second : NULL;
+}
+
+// Returns the path to the scan cache file for a ROM & search settings
+static std::string scanCachePath(const std::string& cacheDir, uint64_t hash, int threshold, uint32_t forcedVersion) {
+    char name[48];
+    snprintf(name, 48, "%016llx-%d-%08x.krs", (unsigned long long)hash, threshold, forcedVersion);
+    return cacheDir + name;
+}
+
+// Loads search results from a scan cache file, returning whether the file exists & matches the format
+// version, the ROM & settings
+static bool loadScanCache(const std::string& path, uint64_t hash, uint32_t romSize, int threshold, uint32_t forcedVersion, OffsetSearchResult& result) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) return false;
+    char magic[4];
+    uint32_t fileVersion = 0;
+    uint64_t fileHash = 0;
+    uint32_t header[11];
+    bool ok = fread(magic, 4, 1, fp) == 1 && memcmp(magic, "KRWS", 4) == 0 &&
+        fread(&fileVersion, 4, 1, fp) == 1 && fileVersion == SCAN_CACHE_VERSION &&
+        fread(&fileHash, 8, 1, fp) == 1 && fileHash == hash &&
+        fread(header, 4, 11, fp) == 11 && header[0] == romSize && header[1] == (uint32_t)threshold && header[2] == forcedVersion;
+    if (ok) {
+        result.version = header[3];
+        result.signatureVersion = header[4];
+        result.signatureFound = header[5];
+        result.instrumentAddr = header[6];
+        result.instrumentCount = header[7];
+        result.sampleAddr = header[8];
+        result.sampleCount = header[9];
+        // The counts are checked before anything is allocated, so a corrupt file is just a miss
+        ok = header[10] < 0x100000;
+    }
+    if (ok) {
+        result.modules.resize(header[10]);
+        ok = fread(result.modules.data(), 4, header[10], fp) == header[10];
+    }
+    uint32_t ncandidates = 0;
+    if (ok) ok = fread(&ncandidates, 4, 1, fp) == 1 && ncandidates < 0x100000;
+    if (ok) {
+        result.candidates.resize(ncandidates);
+        for (OffsetCandidate& c : result.candidates) {
+            uint32_t tmp[4];
+            if (fread(tmp, 4, 4, fp) != 4) {ok = false; break;}
+            c.addr = tmp[0];
+            c.count = tmp[1];
+            c.type = tmp[2];
+            c.confidence = tmp[3];
+        }
+    }
+    fclose(fp);
+    result.success = ok && result.sampleAddr && !result.modules.empty();
+    return ok;
+}
+
+// Saves search results to a scan cache file, returning whether it was written successfully
+// The file is written under a temporary name that's unique to this process & call, then renamed over the
+// cache file, so an interrupted run or another run saving the same results never leaves a partial file.
+static bool saveScanCache(const std::string& path, uint64_t hash, uint32_t romSize, int threshold, uint32_t forcedVersion, const OffsetSearchResult& result) {
+    static std::atomic<unsigned> tempCounter(0);
+#if defined(_WIN32)
+    unsigned long pid = GetCurrentProcessId();
+#elif defined(UNKRAWERTER_USE_MMAP)
+    unsigned long pid = getpid();
+#else
+    unsigned long pid = 0;
+#endif
+    std::string temp = path + "." + std::to_string(pid) + "." + std::to_string(tempCounter++) + ".tmp";
+    FILE* fp = fopen(temp.c_str(), "wb");
+    if (fp == NULL) return false;
+    uint32_t header[11] = {
+        romSize, (uint32_t)threshold, forcedVersion,
+        result.version, result.signatureVersion, result.signatureFound,
+        result.instrumentAddr, result.instrumentCount, result.sampleAddr, result.sampleCount,
+        (uint32_t)result.modules.size()
+    };
+    uint32_t version = SCAN_CACHE_VERSION;
+    fwrite("KRWS", 4, 1, fp);
+    fwrite(&version, 4, 1, fp);
+    fwrite(&hash, 8, 1, fp);
+    fwrite(header, 4, 11, fp);
+    fwrite(result.modules.data(), 4, result.modules.size(), fp);
+    uint32_t ncandidates = result.candidates.size();
+    fwrite(&ncandidates, 4, 1, fp);
+    for (const OffsetCandidate& c : result.candidates) {
+        uint32_t tmp[4] = {c.addr, c.count, (uint32_t)c.type, (uint32_t)c.confidence};
+        fwrite(tmp, 4, 4, fp);
+    }
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = false;
+#ifdef _WIN32
+    if (ok) ok = MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    if (ok) ok = rename(temp.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok) remove(temp.c_str());
+    return ok;
+}
+
+// Writes a search profile to a JSON file, so scans can be compared across ROMs
+// Returns whether the file was written successfully
+static bool writeScanProfile(const char * path, const std::string& romPath, const ScanProfile& profile) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) return false;
+    fputs("{\n  \"rom\": \"", fp);
+    for (char c : romPath) {
+        if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+        else if ((unsigned char)c < 0x20) fprintf(fp, "\\u%04x", c);
+        else fputc(c, fp);
+    }
+    fprintf(fp, "\",\n  \"romSize\": %u,\n  \"threshold\": %u,\n  \"chunks\": %u,\n  \"wallTime\": %.6f,\n", profile.romSize, profile.threshold, profile.chunks, profile.wallTime);
+    fputs("  \"phases\": {", fp);
+    for (int i = 0; i < PHASE_COUNT; i++) fprintf(fp, "%s\"%s\": %.6f", i ? ", " : "", phaseNames[i], profile.phaseTime[i]);
+    fputs("},\n  \"runLengths\": {", fp);
+    for (int i = 0; i < RUN_BUCKETS; i++) {
+        if (i == 0) fprintf(fp, "\"1\": %u", profile.runLengths[i]);
+        else if (i == RUN_BUCKETS - 1) fprintf(fp, ", \"%u+\": %u", 1u << i, profile.runLengths[i]);
+        else fprintf(fp, ", \"%u-%u\": %u", 1u << i, (2u << i) - 1, profile.runLengths[i]);
+    }
+    fprintf(fp, "},\n  \"classified\": %u,\n  \"rejections\": {", profile.classified);
+    for (int i = 0; i < RULE_COUNT; i++) fprintf(fp, "%s\"%s\": %u", i ? ", " : "", ruleNames[i], profile.rejections[i]);
+    fprintf(fp, "},\n  \"lists\": {\"module\": %u, \"sample\": %u, \"instrument\": %u, \"ambiguous\": %u, \"none\": %u}\n}\n",
+        profile.lists[0], profile.lists[1], profile.lists[2], profile.lists[3], profile.lists[4]);
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+// A module to convert, with the format & file name already worked out
+struct ModuleJob {
+    std::unique_ptr<RomImage> ripped; // Ripped module file when converting from a bank, otherwise NULL
+    uint32_t moduleOffset;
+    bool useS3M;
+    std::string title;
+    std::string name;
+};
+
+// Options for converting modules, which are the same for every module in a ROM
+struct ModuleJobOptions {
+    const std::vector<uint32_t> * sampleOffsets;
+    const std::vector<uint32_t> * instrumentOffsets;
+    bool trimInstruments;
+    bool fixCompatibility;
+};
+
+static int convertModule(const ConversionContext& ctx, const RomImage& rom, const ModuleJob& job, const ModuleJobOptions& options, const char * filename) {
+    const RomImage& modrom = job.ripped ? *job.ripped : rom;
+    const char * title = job.title.empty() ? NULL : job.title.c_str();
+    if (job.useS3M) return writeModuleToS3M(ctx, modrom, job.moduleOffset, *options.sampleOffsets, filename, options.trimInstruments, title, rom);
+    else return writeModuleToXM(ctx, modrom, job.moduleOffset, *options.sampleOffsets, *options.instrumentOffsets, filename, options.trimInstruments, title, options.fixCompatibility, rom);
+}
+
+// Converts modules in order, stopping at the first one that fails, and returns its error code (or 0).
+// With more than one thread, the modules are converted on a pool of worker threads. Each one is written
+// to a temporary file and its messages are held back; once every module before it has finished, its
+// messages are printed and the file is renamed, so the output is the same as converting them one by one.
+static int convertModules(const ConversionContext& ctx, const RomImage& rom, const std::vector<ModuleJob>& jobs, const ModuleJobOptions& options, unsigned nthreads) {
+    if (nthreads <= 1 || jobs.size() <= 1) {
+        for (const ModuleJob& job : jobs) {
+            int r = convertModule(ctx, rom, job, options, job.name.c_str());
+            if (r) return r;
+        }
+        return 0;
+    }
+    struct Result {
+        MessageLog log;
+        int code = 0;
+        bool done = false;
+    };
+    std::vector<Result> results(jobs.size());
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::atomic<size_t> next(0);
+    std::atomic<bool> stop(false);
+    auto tempName = [&jobs](size_t i)->std::string {return jobs[i].name + "." + std::to_string(i) + ".tmp";};
+    auto worker = [&]() {
+        for (size_t i; !stop && (i = next++) < jobs.size();) {
+            MessageLog log;
+            threadLog = &log;
+            int r = convertModule(ctx, rom, jobs[i], options, tempName(i).c_str());
+            threadLog = NULL;
+            std::lock_guard<std::mutex> lock(mutex);
+            results[i].log = std::move(log);
+            results[i].code = r;
+            results[i].done = true;
+            finished.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < std::min((size_t)nthreads, jobs.size()); i++) threads.push_back(std::thread(worker));
+    int retval = 0;
+    size_t i;
+    for (i = 0; i < jobs.size() && !retval; i++) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&results, i]()->bool {return results[i].done;});
+        }
+        // Messages mention the temporary file, so they're changed to the real name
+        std::string temp = tempName(i);
+        for (auto& m : results[i].log.messages) {
+            for (size_t pos = m.second.find(temp); pos != std::string::npos; pos = m.second.find(temp, pos + jobs[i].name.size()))
+                m.second.replace(pos, temp.size(), jobs[i].name);
+            fputs(m.second.c_str(), m.first);
+        }
+        // A module that failed may still have left a file behind
+        FILE* tempfp = fopen(temp.c_str(), "rb");
+        if (tempfp != NULL) {
+            fclose(tempfp);
+            remove(jobs[i].name.c_str());
+            rename(temp.c_str(), jobs[i].name.c_str());
+        }
+        if (results[i].code) {
+            retval = results[i].code;
+            stop = true;
+        }
+    }
+    for (std::thread& t : threads) t.join();
+    // Throw away modules that were converted after one that failed
+    for (; i < jobs.size(); i++) if (results[i].done) remove(tempName(i).c_str());
+    return retval;
+}
+
+// Command-line options; in batch mode, these apply to every ROM
+struct CliOptions {
+    std::string romPath;
     std::string outputDir;
+    std::string cacheDir;
+    std::string profilePath;
     int searchThreshold = 4;
+    int nthreads = 1;
     bool verbose = false;
     bool trimInstruments = true;
     bool exportSamples = false;
@@ -1478,262 +2867,239 @@ int main(int argc, const char * argv[]) {
     bool detectVersion = true;
     bool ripModules = false;
     bool useBank = false;
+    bool discover = false;
+    bool batch = false;
+    bool toStdout = false;
     int moduleType = -1;
-    std::string romPath;
+    uint32_t version = 0x20050421;
     uint32_t sampleAddr = 0, instrumentAddr = 0;
     std::vector<uint32_t> additionalModules;
     std::vector<std::string> rippedModulePaths;
     std::map<uint32_t, std::string> nameMap;
-    int nextArg = 0;
-    // Loop through all arguments
-    for (int i = 1; i < argc; i++) {
-        if (nextArg) {
-            switch (nextArg) {
-                case 1: instrumentAddr = atoi(argv[i]); break;
-                case 2: additionalModules.push_back(atoi(argv[i])); break;
-                case 3: outputDir = std::string(argv[i]) + "/"; break;
-                case 4: sampleAddr = atoi(argv[i]); break;
-                case 5: searchThreshold = atoi(argv[i]); break;
-                case 6: {
-                    std::string arg(argv[i]);
-                    size_t pos = arg.find('=');
-                    if (pos == std::string::npos) {
-                        fprintf(stderr, "Error: Invalid argument to -n\n");
-                        return 7;
-                    }
-                    std::string name = arg.substr(pos + 1);
-                    if (name.size() > 20) name.erase(20);
-                    nameMap[std::stoul(arg.substr(0, pos), nullptr, 16) & 0x1ffffff] = name;
-                    break;
-                }
-                case 7: {
-                    FILE* fp = fopen(argv[i], "r");
-                    if (fp == NULL) {
-                        fprintf(stderr, "Error: Invalid argument to -l\n");
-                        return 8;
-                    }
-                    std::string tmpaddr, tmpname;
-                    while (!feof(fp)) {
-                        bool a = false;
-                        tmpaddr.clear();
-                        tmpname.clear();
-                        for (char c = fgetc(fp); c != '\n' && c != EOF; c = fgetc(fp)) {
-                            if (!a && c == '=') a = true;
-                            else if (c >= 0x20) {
-                                if (a) tmpname += c;
-                                else tmpaddr += c;
-                            }
-                        }
-                        if (a && !tmpaddr.empty() && !tmpname.empty()) {
-                            if (tmpname.size() > 20) tmpname.erase(20);
-                            nameMap[std::stoul(tmpaddr, nullptr, 16)] = tmpname;
-                        }
-                    }
-                    fclose(fp);
-                    break;
-                }
-                case 8: useBank = true; rippedModulePaths.push_back(argv[i]); break;
-            }
-            nextArg = 0;
-        } else if (argv[i][0] == '-') {
-            for (int j = 1; j < strlen(argv[i]); j++) {
-                switch (argv[i][j]) {
-                    case '3': moduleType = 1; break;
-                    case 'a': trimInstruments = false; break;
-                    case 'c': fixCompatibility = false; break;
-                    case 'e': exportSamples = true; break;
-                    case 'f': nextArg = 8; break;
-                    case 'i': nextArg = 1; break;
-                    case 'k': version = 0x20030901; detectVersion = false; break;
-                    case 'K': version = 0x20050421; detectVersion = false; break;
-                    case 'l': nextArg = 7; break;
-                    case 'm': nextArg = 2; break;
-                    case 'n': nextArg = 6; break;
-                    case 'o': nextArg = 3; break;
-                    case 'r': ripModules = true; break;
-                    case 's': nextArg = 4; break;
-                    case 't': nextArg = 5; break;
-                    case 'v': verbose = true; break;
-                    case 'x': moduleType = 0; break;
-                }
-            }
-        } else if (romPath.empty()) romPath = argv[i];
-    }
-    // Die if no ROM file was specified
-    if (romPath.empty()) {
-        fprintf(stderr, "Error: No %s file specified.\n", useBank ? "bank" : "ROM");
-        return 4;
-    }
-    std::vector<uint32_t> sampleOffsets, instrumentOffsets, moduleOffsets;
+    std::map<std::string, GameEntry> gameDatabase;
+};
+
+// A ROM (or bank) being converted, and the modules found in it
+struct RomTask {
+    std::string romPath;
+    std::string outputDir;
+    std::string profilePath;
+    ConversionContext ctx;
+    std::unique_ptr<RomImage> rom;
+    std::vector<uint32_t> sampleOffsets, instrumentOffsets;
+    std::vector<ModuleJob> jobs;
+    int missingModule = -1; // Index of the first ripped module that couldn't be opened, or -1 if none
+    unsigned scanThreads = 0; // Maximum number of threads for the offset search (0 = one per CPU core)
+};
+
+// Reads a ROM (or bank) and finds the modules in it, along with anything else that needs to be done before
+// they're converted: exporting samples and ripping are done here. Messages are printed with logMessage.
+// Returns 0 on success, or the exit code for the error.
+static int prepareRom(const CliOptions& opts, RomTask& task) {
+    ConversionContext& ctx = task.ctx;
+    const std::string& romPath = task.romPath;
+    const std::string& outputDir = task.outputDir;
+    std::vector<uint32_t>& sampleOffsets = task.sampleOffsets;
+    std::vector<uint32_t>& instrumentOffsets = task.instrumentOffsets;
+    std::vector<uint32_t> moduleOffsets;
     int moduleOffsetsSize;
+    bool detectVersion = opts.detectVersion;
+    std::map<uint32_t, std::string> nameMap = opts.nameMap;
+    ctx.version = opts.version;
     // Open the ROM file
     FILE* fp = fopen(romPath.c_str(), "rb");
     if (fp == NULL) {
-        fprintf(stderr, "Error: Could not open file %s for reading.\n", romPath.c_str());
+        logMessage(stderr, "Error: Could not open file %s for reading.\n", romPath.c_str());
         return 2;
     }
-    if (useBank) {
-        if (ripModules) {
-            fprintf(stderr, "Error: The -f option cannot be combined with -r.\n");
+    task.rom.reset(new RomImage(fp));
+    fclose(fp);
+    const RomImage& rom = *task.rom;
+    if (opts.useBank) {
+        if (opts.ripModules) {
+            logMessage(stderr, "Error: The -f option cannot be combined with -r.\n");
             return 4;
         }
         // Read the version info
         char ver[4];
-        fread(ver, 4, 1, fp);
+        rom.copy(ver, 0, 4);
         if (ver[0] != 'K' || ver[1] != 'R' || ver[2] != 'W' || (ver[3] != 'B' && ver[3] != 'C')) {
-            fprintf(stderr, "Error: The selected file is not a Krawall bank file.\n");
+            logMessage(stderr, "Error: The selected file is not a Krawall bank file.\n");
             return 9;
         }
-        version = ver[3] & 1 ? 0x20030901 : 0x20050421;
+        ctx.version = ver[3] & 1 ? 0x20030901 : 0x20050421;
         detectVersion = false;
         // Read in instrument and sample info
-        uint16_t instsize = 0, samplesize = 0;
-        fread(&instsize, 2, 1, fp);
-        fread(&samplesize, 2, 1, fp);
-        uint32_t tmp = 0;
-        for (int i = 0; i < instsize; i++) {
-            fread(&tmp, 4, 1, fp);
-            instrumentOffsets.push_back(tmp);
-        }
-        for (int i = 0; i < samplesize; i++) {
-            fread(&tmp, 4, 1, fp);
-            sampleOffsets.push_back(tmp);
-        }
-        moduleOffsetsSize = rippedModulePaths.size();
+        uint16_t instsize = rom.u16(4), samplesize = rom.u16(6);
+        for (int i = 0; i < instsize; i++) instrumentOffsets.push_back(rom.u32(8 + i*4));
+        for (int i = 0; i < samplesize; i++) sampleOffsets.push_back(rom.u32(8 + (instsize + i)*4));
+        moduleOffsetsSize = opts.rippedModulePaths.size();
     } else {
         // Die if the threshold < 1
-        if (searchThreshold < 1) {
-            fprintf(stderr, "Error: Threshold must be at least 1.\n");
+        if (opts.searchThreshold < 1) {
+            logMessage(stderr, "Error: Threshold must be at least 1.\n");
             return 13;
         }
-        // Look for a Krawall signature & version in the file and warn if one isn't found
-        if (!fstr(fp, "$Id: Krawall")) fprintf(stderr, "Warning: Could not find Krawall signature. Are you sure this game uses the Krawall engine?\n");
-        else if (detectVersion && fstr(fp, "$Date: ")) {
-            // $Date: 2000/01/01
-            char tmp[11];
-            fread(tmp, 10, 1, fp);
-            tmp[10] = 0;
-            version = ((tmp[0] - '0') << 28) | ((tmp[1] - '0') << 24) | ((tmp[2] - '0') << 20) | ((tmp[3] - '0') << 16) | ((tmp[5] - '0') << 12) | ((tmp[6] - '0') << 8) | ((tmp[8] - '0') << 4) | (tmp[9] - '0');
-            detectVersion = false;
-            printf("Krawall version: %08x\n", version);
-        } else if (detectVersion) {
-            rewind(fp);
-            if (fstr(fp, "$Id: version.h 8 ")) {
-                // $Id: version.h 8 2000-01-01
-                char tmp[11];
-                fread(tmp, 10, 1, fp);
-                tmp[10] = 0;
-                version = ((tmp[0] - '0') << 28) | ((tmp[1] - '0') << 24) | ((tmp[2] - '0') << 20) | ((tmp[3] - '0') << 16) | ((tmp[5] - '0') << 12) | ((tmp[6] - '0') << 8) | ((tmp[8] - '0') << 4) | (tmp[9] - '0');
+        OffsetSearchResult offsets;
+        uint64_t romHash = !opts.cacheDir.empty() || !opts.gameDatabase.empty() ? hashRom(rom) : 0;
+        // Look the game up in the database if provided; names & the version from the entry are always used,
+        // and if it has the sample list & modules, the search is skipped entirely
+        const GameEntry * game = opts.gameDatabase.empty() ? NULL : findGame(opts.gameDatabase, rom, romHash);
+        if (game) {
+            logMessage(stdout, "Found game in database\n");
+            for (const auto& n : game->names) nameMap.insert(n); // -n/-l names take priority
+            if (detectVersion && game->version) {
+                ctx.version = game->version;
                 detectVersion = false;
-                printf("Krawall version: %08x\n", version);
+                logMessage(stdout, "Krawall version: %08x\n", ctx.version);
             }
         }
-        rewind(fp);
-        // Search for the offsets
-        OffsetSearchResult offsets;
-        offsets = unkrawerter_searchForOffsets(fp, searchThreshold, verbose);
-        // If we didn't find any modules and the version is unknown, try again with the older version
-        if (detectVersion && offsets.modules.empty()) {
-            version = 0x20030901;
-            offsets = unkrawerter_searchForOffsets(fp, searchThreshold, verbose);
-            if (!offsets.modules.empty()) {
-                printf("Auto-detected old pattern version\n");
+        if (game && game->sampleAddr && !game->modules.empty()) {
+            offsets.instrumentAddr = game->instrumentAddr;
+            if (offsets.instrumentAddr) offsets.instrumentCount = countPointers(rom, offsets.instrumentAddr);
+            offsets.sampleAddr = game->sampleAddr;
+            offsets.sampleCount = countPointers(rom, offsets.sampleAddr);
+            offsets.modules = game->modules;
+            showOffsetSearchResult(offsets);
+            if (!task.profilePath.empty()) logMessage(stderr, "Warning: The game is in the database, so there was no search to profile.\n");
+        } else {
+            // Search for the offsets, along with the Krawall signature & version
+            // If the version is unknown, it's read from the signature; failing that, if no modules use the
+            // new pattern format, the older format is used
+            // If a cache directory is set, results from a previous search with the same settings are reused,
+            // unless the search is being profiled
+            std::string cachePath;
+            uint32_t forcedVersion = detectVersion ? 0 : ctx.version;
+            if (!opts.cacheDir.empty()) cachePath = scanCachePath(opts.cacheDir, romHash, opts.searchThreshold, forcedVersion);
+            if (!cachePath.empty() && task.profilePath.empty() && loadScanCache(cachePath, romHash, rom.size(), opts.searchThreshold, forcedVersion, offsets)) {
+                logMessage(stdout, "Using cached scan results from %s\n", cachePath.c_str());
+                if (detectVersion && offsets.signatureVersion) logMessage(stdout, "Krawall version: %08x\n", offsets.signatureVersion);
+                showOffsetSearchResult(offsets);
+            } else {
+                ScanProfile profile;
+                offsets = searchForOffsets(ctx, rom, opts.searchThreshold, opts.verbose, detectVersion, task.profilePath.empty() ? NULL : &profile, task.scanThreads);
+                if (!cachePath.empty() && !saveScanCache(cachePath, romHash, rom.size(), opts.searchThreshold, forcedVersion, offsets))
+                    logMessage(stderr, "Warning: Could not write scan cache file %s.\n", cachePath.c_str());
+                if (!task.profilePath.empty() && !writeScanProfile(task.profilePath.c_str(), romPath, profile))
+                    logMessage(stderr, "Warning: Could not write profile file %s.\n", task.profilePath.c_str());
+            }
+            if (!offsets.signatureFound) logMessage(stderr, "Warning: Could not find Krawall signature. Are you sure this game uses the Krawall engine?\n");
+            if (detectVersion && offsets.signatureVersion) {
+                ctx.version = offsets.signatureVersion;
                 detectVersion = false;
+            } else if (detectVersion && offsets.version != ctx.version) {
+                ctx.version = offsets.version;
+                if (!offsets.modules.empty()) {
+                    logMessage(stdout, "Auto-detected old pattern version\n");
+                    detectVersion = false;
+                }
             }
         }
         // Add in overrides if provided
-        if (sampleAddr) {
-            offsets.sampleAddr = sampleAddr & 0x1ffffff;
-            uint32_t tmp = 0;
-            fseek(fp, offsets.sampleAddr, SEEK_SET);
-            fread(&tmp, 4, 1, fp);
-            for (offsets.sampleCount = 0; (tmp & 0xf6000000) == 0 && (tmp & 0x8000000) == 0x8000000; offsets.sampleCount++) fread(&tmp, 4, 1, fp);
-            rewind(fp);
+        if (opts.sampleAddr) {
+            offsets.sampleAddr = opts.sampleAddr & 0x1ffffff;
+            offsets.sampleCount = countPointers(rom, offsets.sampleAddr);
         }
-        if (instrumentAddr) {
-            offsets.instrumentAddr = instrumentAddr & 0x1ffffff;
-            uint32_t tmp = 0;
-            fseek(fp, offsets.instrumentAddr, SEEK_SET);
-            fread(&tmp, 4, 1, fp);
-            for (offsets.instrumentCount = 0; (tmp & 0xf6000000) == 0 && (tmp & 0x8000000) == 0x8000000; offsets.instrumentCount++) fread(&tmp, 4, 1, fp);
-            rewind(fp);
+        if (opts.instrumentAddr) {
+            offsets.instrumentAddr = opts.instrumentAddr & 0x1ffffff;
+            offsets.instrumentCount = countPointers(rom, offsets.instrumentAddr);
+        }
+        for (uint32_t a : opts.additionalModules) offsets.modules.push_back(a);
+        // Look for modules the search missed by following pointers to them
+        // If the version is still unknown, the other pattern format is tried if nothing is found
+        if (opts.discover) {
+            std::vector<uint32_t> found = discoverModules(ctx, rom, offsets, opts.verbose);
+            if (found.empty() && detectVersion) {
+                uint32_t oldVersion = ctx.version;
+                ctx.version = ctx.version < 0x20040707 ? 0x20050421 : 0x20030901;
+                found = discoverModules(ctx, rom, offsets, opts.verbose);
+                if (found.empty()) ctx.version = oldVersion;
+            }
+            if (!found.empty()) detectVersion = false;
+            offsets.modules.insert(offsets.modules.end(), found.begin(), found.end());
         }
-        for (uint32_t a : additionalModules) offsets.modules.push_back(a);
         offsets.success = offsets.sampleAddr && !offsets.modules.empty();
         // If we don't have all of the required offsets, we can't continue
         if (!offsets.success) {
-            fprintf(stderr, "Could not find all of the offsets required.\n * Does the ROM use the Krawall engine?\n * Try adjusting the search threshold.\n * You may need to find offsets yourself.\n");
+            logMessage(stderr, "Could not find all of the offsets required.\n * Does the ROM use the Krawall engine?\n * Try adjusting the search threshold.\n * You may need to find offsets yourself.\n");
             return 3;
         }
         // Read each of the offsets from the lists in the file into vectors
-        uint32_t tmp = 0;
-        fseek(fp, offsets.sampleAddr, SEEK_SET);
-        for (int i = 0; i < offsets.sampleCount; i++) {
-            fread(&tmp, 4, 1, fp);
-            sampleOffsets.push_back(tmp & 0x1ffffff);
-        }
+        for (int i = 0; i < offsets.sampleCount; i++) sampleOffsets.push_back(rom.u32(offsets.sampleAddr + i*4) & 0x1ffffff);
         if (offsets.instrumentAddr) {
-            fseek(fp, offsets.instrumentAddr, SEEK_SET);
-            for (int i = 0; i < offsets.instrumentCount; i++) {
-                fread(&tmp, 4, 1, fp);
-                instrumentOffsets.push_back(tmp & 0x1ffffff);
-            }
+            for (int i = 0; i < offsets.instrumentCount; i++) instrumentOffsets.push_back(rom.u32(offsets.instrumentAddr + i*4) & 0x1ffffff);
         }
         moduleOffsets = offsets.modules;
+        // Only one module can be written to stdout, so any modules given with -m pick which ones to write
+        if (opts.toStdout && !opts.additionalModules.empty()) moduleOffsets = opts.additionalModules;
         moduleOffsetsSize = moduleOffsets.size();
     }
+    if (opts.toStdout && moduleOffsetsSize != 1) {
+        logMessage(stderr, "Error: Only one module can be written to stdout, but %d were found.\n", moduleOffsetsSize);
+        if (!opts.useBank) {
+            logMessage(stderr, "Choose one with -m:\n");
+            for (uint32_t addr : moduleOffsets) logMessage(stderr, "  -m %u  (module at %08X)\n", addr, addr);
+        }
+        return 17;
+    }
     // Export all WAV samples (if desired)
-    if (exportSamples) {
+    if (opts.exportSamples) {
         for (int i = 0; i < sampleOffsets.size(); i++) {
             std::string name = outputDir + "Sample" + std::to_string(i) + ".wav";
-            unkrawerter_readSampleToWAV(fp, sampleOffsets[i], name.c_str());
-            printf("Wrote sample %d to %s\n", i, name.c_str());
+            readSampleToWAV(rom, sampleOffsets[i], name.c_str());
+            logMessage(stdout, "Wrote sample %d to %s\n", i, name.c_str());
         }
     }
     // Write the instrument/sample bank (if desired)
-    if (ripModules) {
-        bool ok = unkrawerter_writeBankFile(fp, sampleOffsets, instrumentOffsets, (outputDir + romPath.substr(romPath.find_last_of("/\\") + 1) + ".krb").c_str());
+    if (opts.ripModules) {
+        bool ok = writeBankFile(ctx, rom, sampleOffsets, instrumentOffsets, (outputDir + romPath.substr(romPath.find_last_of("/\\") + 1) + ".krb").c_str());
         if (!ok) {
-            fclose(fp);
             return 2;
         }
     }
     // Write out all of the new modules
-    for (int i = 0; i < moduleOffsetsSize; i++) {
-        if (ripModules) {
+    if (opts.ripModules) {
+        for (int i = 0; i < moduleOffsetsSize; i++) {
             std::string name = outputDir + (nameMap.find(moduleOffsets[i]) != nameMap.end() ? nameMap[moduleOffsets[i]] : "Module" + std::to_string(i)) + ".krw";
-            bool ok = unkrawerter_writeModuleFile(fp, moduleOffsets[i], name.c_str());
+            bool ok = writeModuleFile(ctx, rom, moduleOffsets[i], name.c_str());
             if (!ok) {
-                fclose(fp);
                 return 2;
             }
-        } else {
-            FILE* modfp = fp;
-            if (useBank) modfp = fopen(rippedModulePaths[i].c_str(), "rb");
+        }
+    } else {
+        // Work out the format & file name of every module first, since the version may be detected from
+        // the first module; after that, the modules can be converted in any order
+        for (int i = 0; i < moduleOffsetsSize; i++) {
+            ModuleJob job;
+            if (opts.useBank) {
+                FILE* modfp = fopen(opts.rippedModulePaths[i].c_str(), "rb");
+                if (modfp == NULL) {
+                    task.missingModule = i;
+                    break;
+                }
+                job.ripped.reset(new RomImage(modfp));
+                fclose(modfp);
+            }
+            const RomImage& modrom = opts.useBank ? *job.ripped : rom;
+            uint32_t moduleOffset = opts.useBank ? 4 : moduleOffsets[i];
             // Detect whether to use S3M or XM module format
-            fseek(modfp, (useBank ? 4 : moduleOffsets[i]) + 358, SEEK_SET);
-            bool useS3M = (!fgetc(modfp) && moduleType != 0) || moduleType == 1; // Check the instrumentBased flag
-            if (useS3M && moduleType != 1 && !detectVersion) {
+            bool useS3M = (!modrom.u8(moduleOffset + 358) && opts.moduleType != 0) || opts.moduleType == 1; // Check the instrumentBased flag
+            if (useS3M && opts.moduleType != 1 && !detectVersion) {
                 // Also check that the first module (at least) has exactly 64 rows
-                uint32_t tmp = 0;
+                uint32_t tmp = modrom.u32(moduleOffset + 364);
                 uint16_t tmp16 = 0;
-                fseek(modfp, 5, SEEK_CUR);
-                fread(&tmp, 4, 1, modfp);
-                fseek(modfp, (tmp & 0x1ffffff) + 32, SEEK_SET);
-                if (version < 0x20040707) tmp16 = fgetc(modfp);
-                else fread(&tmp16, 2, 1, modfp);
+                if (ctx.version < 0x20040707) tmp16 = modrom.u8((tmp & 0x1ffffff) + 32);
+                else tmp16 = modrom.u16((tmp & 0x1ffffff) + 32);
                 useS3M = tmp16 == 64;
             }
             // Detect version if no signature version is available
             else if (detectVersion) {
                 // Also check that the first module (at least) has exactly 64 rows
-                uint32_t addr[4] = {0, 0, 0, 0};
-                char tmprows[2];
-                fseek(modfp, 5, SEEK_CUR);
-                fread(addr, 4, 4, modfp);
-                for (int i = 0; detectVersion && i < searchThreshold && (addr[i] & 0xfe000000) == 0x8000000; i++) {
-                    fseek(modfp, (addr[i] & 0x1ffffff) + 32, SEEK_SET);
-                    fread(tmprows, 1, 2, modfp);
+                uint32_t addr[4];
+                char tmprows[2] = {0, 0};
+                modrom.copy(addr, moduleOffset + 364, 16);
+                for (int i = 0; detectVersion && i < opts.searchThreshold && (addr[i] & 0xfe000000) == 0x8000000; i++) {
+                    modrom.copy(tmprows, (addr[i] & 0x1ffffff) + 32, 2);
                     // Scenarios:
                     // - Byte 2 is 0:
                     //   > Using new version, less than 256 rows
@@ -1747,40 +3113,466 @@ int main(int argc, const char * argv[]) {
                     //   > Using new version, more than 256 rows (unlikely; impossible when using S3M)
                     if (tmprows[1] == 0) {
                         if (tmprows[0] == 64 && useS3M) {
-                            printf("Auto-detected new pattern version\n");
-                            version = 0x20050421;
+                            logMessage(stdout, "Auto-detected new pattern version\n");
+                            ctx.version = 0x20050421;
                             detectVersion = false;
                         }
                     } else {
                         if ((tmprows[1] & 0xE0) == 0) {
-                            printf("Auto-detected new pattern version\n");
-                            version = 0x20050421;
+                            logMessage(stdout, "Auto-detected new pattern version\n");
+                            ctx.version = 0x20050421;
                             detectVersion = false;
                         } else {
-                            printf("Auto-detected old pattern version\n");
-                            version = 0x20030901;
+                            logMessage(stdout, "Auto-detected old pattern version\n");
+                            ctx.version = 0x20030901;
                             detectVersion = false;
                         }
                     }
                 }
                 // If all of the second bytes are 0, the version is more likely than not to be new
                 if (detectVersion) {
-                    printf("Auto-detected new pattern version\n");
-                    version = 0x20050421;
+                    logMessage(stdout, "Auto-detected new pattern version\n");
+                    ctx.version = 0x20050421;
                     detectVersion = false;
                 }
-                if (useS3M && moduleType != 1 && !detectVersion)
-                    useS3M = tmprows[0] == 64 && (version < 0x20040707 ? true : tmprows[1] == 0);
+                if (useS3M && opts.moduleType != 1 && !detectVersion)
+                    useS3M = tmprows[0] == 64 && (ctx.version < 0x20040707 ? true : tmprows[1] == 0);
+            }
+            std::string title = (opts.useBank ? opts.rippedModulePaths[i].substr(opts.rippedModulePaths[i].find_last_of("/\\") + 1, opts.rippedModulePaths[i].find(".krw") - (opts.rippedModulePaths[i].find_last_of("/\\") + 1)) : (nameMap.find(moduleOffsets[i]) != nameMap.end() ? nameMap[moduleOffsets[i]] : ""));
+            std::string name = opts.toStdout ? "-" : outputDir + (title.empty() ? "Module" + std::to_string(i) : title) + (useS3M ? ".s3m" : ".xm");
+            job.moduleOffset = moduleOffset;
+            job.useS3M = useS3M;
+            job.title = title;
+            job.name = name;
+            task.jobs.push_back(std::move(job));
+        }
+    }
+    return 0;
+}
+
+
+// Index of the pool worker running on the current thread, or -1
+static thread_local int poolWorker = -1;
+
+// Pool of threads that run tasks. Each thread has its own queue, and takes the newest task from it; when
+// it's empty, the thread steals the oldest task from another thread's queue. Tasks may add more tasks,
+// which go on the queue of the thread running them, so work that a task leads to is usually done next
+// by the same thread while idle threads pick up everything else.
+class WorkStealingPool {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()> > tasks;
+    };
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::mutex stateMutex;
+    std::condition_variable wake;
+    long queued = 0;  // Tasks waiting in queues; may briefly go negative while a task is being added
+    long pending = 0; // Tasks waiting or running; the pool is done when this reaches 0
+    size_t nextQueue = 0;
+
+    bool take(size_t self, std::function<void()>& task) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& q = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.tasks.empty()) continue;
+            if (i == 0) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        poolWorker = self;
+        std::function<void()> task;
+        while (true) {
+            if (take(self, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(stateMutex);
+                    queued--;
+                }
+                task();
+                task = nullptr;
+                std::lock_guard<std::mutex> lock(stateMutex);
+                if (--pending == 0) wake.notify_all();
+            } else {
+                std::unique_lock<std::mutex> lock(stateMutex);
+                if (pending == 0) break;
+                wake.wait(lock, [this]()->bool {return queued > 0 || pending == 0;});
             }
-            std::string title = (useBank ? rippedModulePaths[i].substr(rippedModulePaths[i].find_last_of("/\\") + 1, rippedModulePaths[i].find(".krw") - (rippedModulePaths[i].find_last_of("/\\") + 1)) : (nameMap.find(moduleOffsets[i]) != nameMap.end() ? nameMap[moduleOffsets[i]] : ""));
-            std::string name = outputDir + (title.empty() ? "Module" + std::to_string(i) : title) + (useS3M ? ".s3m" : ".xm");
-            int r;
-            if (useS3M) r = unkrawerter_writeModuleToS3M(modfp, useBank ? 4 : moduleOffsets[i], sampleOffsets, name.c_str(), trimInstruments, title.empty() ? NULL : title.c_str(), fp);
-            else r = unkrawerter_writeModuleToXM(modfp, useBank ? 4 : moduleOffsets[i], sampleOffsets, instrumentOffsets, name.c_str(), trimInstruments, title.empty() ? NULL : title.c_str(), fixCompatibility, fp);
-            if (r) {fclose(fp); return r;}
         }
+        poolWorker = -1;
+    }
+
+public:
+    explicit WorkStealingPool(unsigned nthreads) {
+        for (unsigned i = 0; i < std::max(nthreads, 1u); i++) queues.push_back(std::unique_ptr<Queue>(new Queue));
+    }
+
+    // Adds a task to the current worker's queue, or spreads tasks over all queues if not called from a task
+    void push(std::function<void()> task) {
+        size_t q;
+        {
+            // The task is counted before it can run, so pending can't reach 0 while a task is being added
+            std::lock_guard<std::mutex> lock(stateMutex);
+            pending++;
+            q = poolWorker >= 0 ? poolWorker : nextQueue++ % queues.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            queues[q]->tasks.push_back(std::move(task));
+        }
+        std::lock_guard<std::mutex> lock(stateMutex);
+        queued++;
+        wake.notify_all();
+    }
+
+    // Runs tasks until all of them (including ones added while running) have finished
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < queues.size(); i++) threads.push_back(std::thread(&WorkStealingPool::work, this, i));
+        work(0);
+        for (std::thread& t : threads) t.join();
+    }
+};
+
+// Prints the messages from a log, with a prefix at the start of each line
+static void printMessages(const MessageLog& log, const std::string& prefix) {
+    bool lineStart[2] = {true, true};
+    for (const auto& m : log.messages) {
+        bool& start = lineStart[m.first == stderr];
+        for (char c : m.second) {
+            if (start) fputs(prefix.c_str(), m.first);
+            fputc(c, m.first);
+            start = c == '\n';
+        }
+    }
+}
+
+// Checks whether a file name has a GBA ROM extension (.gba, .agb or .bin)
+static bool isRomFileName(const std::string& name) {
+    if (name.size() < 4) return false;
+    std::string ext = name.substr(name.size() - 4);
+    for (char& c : ext) c = tolower(c);
+    return ext == ".gba" || ext == ".agb" || ext == ".bin";
+}
+
+// Lists the ROMs to convert in batch mode: every ROM file in a directory, or each line of a list file
+// (blank lines and lines starting with '#' are skipped). Returns false if the path couldn't be read.
+static bool listBatchRoms(const std::string& path, std::vector<std::string>& roms) {
+#if defined(__unix__) || defined(__APPLE__)
+    DIR* dir = opendir(path.c_str());
+    if (dir != NULL) {
+        for (struct dirent * ent = readdir(dir); ent != NULL; ent = readdir(dir))
+            if (isRomFileName(ent->d_name)) roms.push_back(path + "/" + ent->d_name);
+        closedir(dir);
+        std::sort(roms.begin(), roms.end());
+        return true;
+    }
+#elif defined(_WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((path + "\\*").c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isRomFileName(data.cFileName)) roms.push_back(path + "\\" + data.cFileName);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+        std::sort(roms.begin(), roms.end());
+        return true;
+    }
+#endif
+    FILE* fp = fopen(path.c_str(), "r");
+    if (fp == NULL) return false;
+    std::string line;
+    for (int c = fgetc(fp); ; c = fgetc(fp)) {
+        if (c == '\n' || c == EOF) {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+            if (!line.empty() && line[0] != '#') roms.push_back(line);
+            line.clear();
+            if (c == EOF) break;
+        } else line += (char)c;
     }
     fclose(fp);
+    return true;
+}
+
+// Creates a directory if it doesn't exist yet
+static bool makeDirectory(const std::string& path) {
+#ifdef _WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+// A ROM in batch mode, along with how its conversion went
+struct BatchItem {
+    RomTask task;
+    std::string name;                // Name of the ROM's output directory, also used to label its messages
+    std::atomic<int> error{0};       // Exit code of the first error for the ROM, or 0
+    std::atomic<int> converted{0};   // Number of modules converted successfully
+    std::atomic<int> remaining{0};   // Number of modules left to convert
+};
+
+// Converts every ROM in a directory, or listed in a text file, writing each one's files to a subdirectory of
+// the output directory named after it. Scanning ROMs and converting modules are all tasks on one work-stealing
+// pool, so threads aren't left idle on ROMs with few modules. A ROM that fails doesn't stop the others, and
+// a summary is printed at the end. Returns 0 if every ROM was converted, or 16 if any failed.
+static int runBatch(const CliOptions& opts) {
+    if (opts.useBank) {
+        fprintf(stderr, "Error: The -f option cannot be used in batch mode.\n");
+        return 4;
+    }
+    std::vector<std::string> roms;
+    if (!listBatchRoms(opts.romPath, roms)) {
+        fprintf(stderr, "Error: Could not open file %s for reading.\n", opts.romPath.c_str());
+        return 2;
+    }
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<BatchItem> > items;
+    std::map<std::string, int> names;
+    for (const std::string& path : roms) {
+        std::unique_ptr<BatchItem> item(new BatchItem);
+        std::string name = path.substr(path.find_last_of("/\\") + 1);
+        name = name.substr(0, name.find_last_of('.'));
+        // ROMs with the same name from different directories get numbered output directories
+        int n = ++names[name];
+        if (n > 1) name += "_" + std::to_string(n);
+        item->name = name;
+        item->task.romPath = path;
+        item->task.outputDir = opts.outputDir + name + "/";
+        // Each ROM is scanned on the pool thread running it, so the -j limit covers the scans as well
+        item->task.scanThreads = 1;
+        if (!opts.profilePath.empty()) item->task.profilePath = item->task.outputDir + opts.profilePath.substr(opts.profilePath.find_last_of("/\\") + 1);
+        items.push_back(std::move(item));
+    }
+
+    WorkStealingPool pool(opts.nthreads);
+    std::mutex printMutex;
+    // Messages from each task are printed together, labeled with the ROM they're for
+    auto finishTask = [&printMutex](BatchItem * item, MessageLog& log) {
+        threadLog = NULL;
+        std::lock_guard<std::mutex> lock(printMutex);
+        printMessages(log, "[" + item->name + "] ");
+    };
+    for (std::unique_ptr<BatchItem>& ptr : items) {
+        BatchItem * item = ptr.get();
+        pool.push([&opts, &pool, &finishTask, item]() {
+            MessageLog log;
+            threadLog = &log;
+            RomTask& task = item->task;
+            int r;
+            if (!makeDirectory(task.outputDir)) {
+                logMessage(stderr, "Error: Could not create output directory %s.\n", task.outputDir.c_str());
+                r = 2;
+            } else r = prepareRom(opts, task);
+            item->error = r;
+            item->remaining = r ? 0 : task.jobs.size();
+            if (r || task.jobs.empty()) task.rom.reset();
+            finishTask(item, log);
+            if (r) return;
+            for (size_t i = 0; i < task.jobs.size(); i++) {
+                pool.push([&opts, &finishTask, item, i]() {
+                    MessageLog log;
+                    threadLog = &log;
+                    RomTask& task = item->task;
+                    ModuleJobOptions options = {&task.sampleOffsets, &task.instrumentOffsets, opts.trimInstruments, opts.fixCompatibility};
+                    int r = convertModule(task.ctx, *task.rom, task.jobs[i], options, task.jobs[i].name.c_str());
+                    if (r) {
+                        int expected = 0;
+                        item->error.compare_exchange_strong(expected, r);
+                    } else item->converted++;
+                    finishTask(item, log);
+                    // The ROM isn't needed once all of its modules are done
+                    if (--item->remaining == 0) task.rom.reset();
+                });
+            }
+        });
+    }
+    pool.run();
+
+    int failed = 0, modules = 0;
+    printf("\nBatch summary:\n");
+    for (const std::unique_ptr<BatchItem>& item : items) {
+        if (item->error) {
+            failed++;
+            printf("  FAILED %s (error %d, %d of %d modules converted)\n", item->task.romPath.c_str(), (int)item->error, (int)item->converted, (int)item->task.jobs.size());
+        } else printf("  OK     %s (%d modules)\n", item->task.romPath.c_str(), (int)item->converted);
+        modules += item->converted;
+    }
+    printf("Converted %d modules from %d of %d ROMs in %.2f seconds\n", modules, (int)items.size() - failed, (int)items.size(),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count());
+    return failed ? 16 : 0;
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc < 2 || strcmp(argv[1], "-h") == 0) {
+        // Help
+        fprintf(stderr, "Usage: %s [options...] <rom.gba>\n"
+                        "Options:\n"
+                        "  -d <directory>    Cache scan results in a directory, so later runs on the same ROM skip the search\n"
+                        "  -f <file.krm>     Ripped module to convert; may be used multiple times\n"
+                        "                      If this option is specified, the <rom.gba> argument must point to the bank instead\n"
+                        "  -g <file.txt>     Use known offsets, names and versions from a game database file\n"
+                        "  -i <address>      Override instrument list address\n"
+                        "  -j <threads>      Convert modules on multiple threads (0 = one per CPU core, defaults to 1)\n"
+                        "  -l <file.txt>     Read module names from a file (one name/line, same format as -n)\n"
+                        "  -m <address>      Add an extra module address to the list\n"
+                        "  -n <addr>=<name>  Assign a name to a module address (max. 20 characters for XM, 28 for S3M)\n"
+                        "  -o <directory>    Output directory, or - to write the module to stdout (messages go to stderr)\n"
+                        "  -p <file.json>    Write timings & statistics for the search to a JSON file\n"
+                        "  -s <address>      Override sample list address\n"
+                        "  -t <threshold>    Search threshold, lower = slower but finds smaller modules,\n"
+                        "                      higher = faster but misses smaller modules (defaults to 4)\n"
+                        "  -3                Force extraction to output S3M modules (only supported with some modules)\n"
+                        "  -a                Do not trim extra instruments; this will make modules much larger in size!\n"
+                        "  -b                Batch mode: <rom.gba> is a directory of ROMs or a text file listing them (one/line);\n"
+                        "                      each ROM is converted into its own subdirectory of the output directory\n"
+                        "  -c                Disable compatibility fixes, makes patterns more accurate but worsens playback\n"
+                        "  -e                Export samples to WAV files\n"
+                        "  -k                Force Krawall version to 20030901 (disables auto-detection)\n"
+                        "  -K                Force Krawall version to 20050421 (disables auto-detection)\n"
+                        "  -r                Rip data into Krawall bank/modules without conversion\n"
+                        "  -v                Enable verbose mode\n"
+                        "  -w                Discover modules by following pointers to them; finds modules with fewer\n"
+                        "                      patterns than the threshold without searching the whole ROM more slowly\n"
+                        "  -x                Force extraction to output XM modules\n"
+                        "  -h                Show this help\n", argv[0]);
+        return 1;
+    }
+    // Command-line argument parsing
+    CliOptions opts;
+    int nextArg = 0;
+    // Loop through all arguments
+    for (int i = 1; i < argc; i++) {
+        if (nextArg) {
+            switch (nextArg) {
+                case 1: opts.instrumentAddr = atoi(argv[i]); break;
+                case 2: opts.additionalModules.push_back(atoi(argv[i])); break;
+                case 3:
+                    if (strcmp(argv[i], "-") == 0) opts.toStdout = true;
+                    else opts.outputDir = std::string(argv[i]) + "/";
+                    break;
+                case 4: opts.sampleAddr = atoi(argv[i]); break;
+                case 5: opts.searchThreshold = atoi(argv[i]); break;
+                case 6: {
+                    std::string arg(argv[i]);
+                    size_t pos = arg.find('=');
+                    if (pos == std::string::npos) {
+                        fprintf(stderr, "Error: Invalid argument to -n\n");
+                        return 7;
+                    }
+                    std::string name = arg.substr(pos + 1);
+                    if (name.size() > 20) name.erase(20);
+                    opts.nameMap[std::stoul(arg.substr(0, pos), nullptr, 16) & 0x1ffffff] = name;
+                    break;
+                }
+                case 7: {
+                    FILE* fp = fopen(argv[i], "r");
+                    if (fp == NULL) {
+                        fprintf(stderr, "Error: Invalid argument to -l\n");
+                        return 8;
+                    }
+                    std::string tmpaddr, tmpname;
+                    while (!feof(fp)) {
+                        bool a = false;
+                        tmpaddr.clear();
+                        tmpname.clear();
+                        for (char c = fgetc(fp); c != '\n' && c != EOF; c = fgetc(fp)) {
+                            if (!a && c == '=') a = true;
+                            else if (c >= 0x20) {
+                                if (a) tmpname += c;
+                                else tmpaddr += c;
+                            }
+                        }
+                        if (a && !tmpaddr.empty() && !tmpname.empty()) {
+                            if (tmpname.size() > 20) tmpname.erase(20);
+                            opts.nameMap[std::stoul(tmpaddr, nullptr, 16)] = tmpname;
+                        }
+                    }
+                    fclose(fp);
+                    break;
+                }
+                case 8: opts.useBank = true; opts.rippedModulePaths.push_back(argv[i]); break;
+                case 9: opts.cacheDir = std::string(argv[i]) + "/"; break;
+                case 10:
+                    if (!loadGameDatabase(argv[i], opts.gameDatabase)) {
+                        fprintf(stderr, "Error: Invalid argument to -g\n");
+                        return 14;
+                    }
+                    break;
+                case 11: opts.profilePath = argv[i]; break;
+                case 12: opts.nthreads = atoi(argv[i]); break;
+            }
+            nextArg = 0;
+        } else if (argv[i][0] == '-') {
+            for (int j = 1; j < strlen(argv[i]); j++) {
+                switch (argv[i][j]) {
+                    case '3': opts.moduleType = 1; break;
+                    case 'a': opts.trimInstruments = false; break;
+                    case 'b': opts.batch = true; break;
+                    case 'c': opts.fixCompatibility = false; break;
+                    case 'd': nextArg = 9; break;
+                    case 'e': opts.exportSamples = true; break;
+                    case 'f': nextArg = 8; break;
+                    case 'g': nextArg = 10; break;
+                    case 'i': nextArg = 1; break;
+                    case 'j': nextArg = 12; break;
+                    case 'k': opts.version = 0x20030901; opts.detectVersion = false; break;
+                    case 'K': opts.version = 0x20050421; opts.detectVersion = false; break;
+                    case 'l': nextArg = 7; break;
+                    case 'm': nextArg = 2; break;
+                    case 'n': nextArg = 6; break;
+                    case 'o': nextArg = 3; break;
+                    case 'p': nextArg = 11; break;
+                    case 'r': opts.ripModules = true; break;
+                    case 's': nextArg = 4; break;
+                    case 't': nextArg = 5; break;
+                    case 'v': opts.verbose = true; break;
+                    case 'w': opts.discover = true; break;
+                    case 'x': opts.moduleType = 0; break;
+                }
+            }
+        } else if (opts.romPath.empty()) opts.romPath = argv[i];
+    }
+    if (opts.nthreads < 0) {
+        fprintf(stderr, "Error: Invalid argument to -j\n");
+        return 15;
+    }
+    if (opts.nthreads == 0) opts.nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+    // With -o -, stdout only gets the module, and all messages go to stderr
+    if (opts.toStdout) {
+        if (opts.batch || opts.ripModules || opts.exportSamples) {
+            fprintf(stderr, "Error: The -o - option cannot be combined with -b, -e or -r.\n");
+            return 4;
+        }
+        stdoutHasData = true;
+    }
+    // Die if no ROM file was specified
+    if (opts.romPath.empty()) {
+        fprintf(stderr, "Error: No %s file specified.\n", opts.batch ? "ROM directory or list" : opts.useBank ? "bank" : "ROM");
+        return 4;
+    }
+    if (opts.batch) return runBatch(opts);
+    RomTask task;
+    task.romPath = opts.romPath;
+    task.outputDir = opts.outputDir;
+    task.profilePath = opts.profilePath;
+    int r = prepareRom(opts, task);
+    if (r) return r;
+    ModuleJobOptions options = {&task.sampleOffsets, &task.instrumentOffsets, opts.trimInstruments, opts.fixCompatibility};
+    r = convertModules(task.ctx, *task.rom, task.jobs, options, opts.nthreads);
+    if (r) return r;
+    // The modules before one that couldn't be opened are still written
+    if (task.missingModule >= 0) {
+        fprintf(stderr, "Error: Could not open file %s for reading.\n", opts.rippedModulePaths[task.missingModule].c_str());
+        return 2;
+    }
     return 0;
 }
 